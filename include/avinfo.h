@@ -7,16 +7,21 @@
 #define AVINFO_H
 
 #include <stdbool.h>
+#include <windows.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/audio_fifo.h>
+#include <libavutil/fifo.h>
 #include <libavutil/file.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
+#include "blend.h"
+
 #define REPETITION_LIMIT 50  /* maximum number of repetition times of an image file */
+#define GRAY_TOLERANCE 3     /* largest difference of color channels of a gray pixel, for JPEG noise */
 
 extern const double VS_framerate;
 extern const int VS_samplerate;
@@ -24,17 +29,92 @@ extern const int WAV_samplerate;
 extern const int MP3_framesize;
 extern const int AAC_framesize;
 extern const int WAV_framesize;
+extern const int VFR_timebase;
+extern const double VFR_keyframe_interval;
+
+extern const int MPEG4_gop_size;
+extern const int H264_gop_size;
+
+typedef enum VSCodec
+{
+	VSCODEC_AUTO,   /* H.264 if libx264 is available, MPEG-4 otherwise */
+	VSCODEC_H264,
+	VSCODEC_MPEG4
+} VSCodec;
+
+typedef enum VSComposite
+{
+	VSCOMPOSITE_RGBA,  /* compose pages in RGBA and convert the result to YUV420P */
+	VSCOMPOSITE_YUV    /* scale and blend pages straight in YUV420P */
+} VSComposite;
+
+/* quality tiers of swscale; see "scaler_flags" */
+typedef enum VSQuality
+{
+	VSQUALITY_DRAFT,     /* fast bilinear */
+	VSQUALITY_STANDARD,  /* area for downscaling, bicubic for upscaling */
+	VSQUALITY_HIGH       /* Lanczos */
+} VSQuality;
+
+/* Export options. They are set by the command "config" and apply to every export. */
+typedef struct VSConfig
+{
+	VSCodec codec;
+	bool vfr;         /* variable frame rate: each page is written as a single frame (mp4/mov only) */
+	int threads;      /* number of threads of the video encoder; 0 for auto-detection */
+	int thread_type;  /* FF_THREAD_SLICE, FF_THREAD_FRAME or both */
+	int qscale;       /* constant quantizer of MPEG-4, from 1 (best) to 31 */
+	int crf;          /* constant rate factor of H.264, from 0 (best) to 51 */
+	int workers;      /* number of threads composing frames; 0 for auto-detection */
+	int segments;     /* number of segments of the image track encoded in parallel; 1 for off, 0 for auto */
+	VSComposite composite;
+	VSQuality quality;          /* scaler of the images of the video file */
+	VSQuality preview_quality;  /* scaler of the previews shown by "partition" */
+	bool draft_backgrounds;     /* whether drafts compose background images */
+	int scaler_threads;         /* threads of each scaler of the video file; 0 for auto */
+	/* The width or the height of the video file, the other following the images; both 0 for auto. */
+	int video_width;
+	int video_height;
+	bool gray_pages;  /* whether grayscale images are composed in GRAY8; see "detect_gray" */
+	int decode_memory;  /* megabytes of decoded images held by all threads at the same time; 0 for no limit */
+	int source_cache;   /* megabytes of decoded images kept for previews and exports; 0 for off */
+} VSConfig;
+extern VSConfig vs_config;
 
 typedef enum AVType
 {
 	AVTYPE_IMAGE,
 	AVTYPE_AUDIO,
 	AVTYPE_BG_IMAGE,
-	AVTYPE_BMP,
 	AVTYPE_WAV,
 	AVTYPE_VIDEO
 } AVType;
 
+/* The packets of an encoded image, kept to be reused by the next export. */
+typedef struct EncodedImage
+{
+	uint64_t key;          /* see "image_cache_key" */
+	int nb_packets;        /* 0 if the image is not encoded yet */
+	AVPacket **packets;
+	int64_t bytes_written; /* size of all packets written for the image in the current export */
+	int64_t ticks_written; /* in the time base of the video codec */
+} EncodedImage;
+
+/**
+ * An image sent to the video encoder whose packets are not written yet.
+ * If the packets of the codec can be copied, "packets" are the key frame and, if needed, 
+ * the P-frame repeated after it. Otherwise, or if the P-frame fails the check of 
+ * "encode_still_image", there is a packet for every frame.
+ */
+typedef struct PendingImage
+{
+	int64_t begin_pts;     /* in the time base of the video codec */
+	int64_t nb_ticks;      /* in the time base of the video codec */
+	int nb_packets;
+	AVPacket **packets;    /* a packet is received when its data is not NULL */
+	EncodedImage *cache_entry;  /* receives the packets once they are written; may be NULL */
+} PendingImage;
+
 typedef struct AVInfo
 {
 	AVFormatContext *fmt_ctx;
@@ -42,6 +122,19 @@ typedef struct AVInfo
 	AVCodecContext  *codec_ctx2;  /* video codec context for video file */
 	AVPacket *packet;
 	AVFrame  *frame;
+	AVPacket *packet2;  /* packet of the video stream for video file */
+	AVFrame  *frame2;   /* frame of the video stream for video file */
+	AVPacket *packet3;  /* written to the video stream for video file; see "write_image_packets" */
+	AVCodecContext  *codec_ctx3;  /* decoder of the video packets for video file; see "encode_still_image" */
+	AVFrame  *frame3;   /* the key frame of the image being encoded, as decoded by "codec_ctx3" */
+	bool hold_pending;  /* whether "write_pending_images" waits for the check of a still image */
+	AVFrame  *rendered; /* background image at the size of the video file; see "render_background" */
+	AVFrame  *rendered_gray;  /* the same in GRAY8 pixel format, for grayscale images */
+	int bg_uses;  /* compositions left in the export that blend this background image; 0 if not counted */
+	AVFrame  *decoded;  /* decoded image kept by the source cache; see "decode_source" */
+	int64_t decoded_used;  /* when "decoded" was last used, for the source cache */
+	int64_t reserved;  /* bytes of the decode budget taken by "frame"; see "release_source" */
+	bool consumed;  /* whether a packet has been read since the input was opened */
 
 	AVType type;
 	wchar_t *filename;
@@ -56,11 +149,16 @@ typedef struct AVInfo
 	 */
 	int nb_repetition;
 	double *duration;  /* in seconds; 3.0 by default; is negative if unspecified */
-	wchar_t *bmp_filename;  /* The name of bmp file for display. */
-	char *bmp_filename_utf8;
 
 	bool partitioned;  /* for audio track */
+	BlendMode blend;   /* for background image track */
+	bool gray;         /* for image and background image track: the image has no color */
+	uint64_t content_hash;  /* the hash of the file when "gray" was detected; see "refresh_image" */
 	int frame_size;    /* the frame size of the audio stream in the video file */
+	bool vfr;          /* whether the video stream of the video file has variable frame rate */
+	bool copy_frames;  /* whether the packets of the video encoder can be written more than once */
+	enum AVPixelFormat compose_fmt;  /* pixel format the pages of the video file are composed in */
+	AVFifo *pending;   /* images of the video file sent to the encoder but not written yet */
 
 	/**
 	 * for audio & background image track
@@ -69,6 +167,11 @@ typedef struct AVInfo
 	 */
 	int begin;
 	int end;
+	/**
+	 * For background image: guards decoding when images are composed in parallel.
+	 * For video or wav file: guards the muxer since both tracks are written in parallel.
+	 */
+	CRITICAL_SECTION lock;
 	
 	/* for all types of file except audio file */
 	int width;
@@ -93,37 +196,255 @@ extern bool AVInfo_open(AVInfo *av_info, wchar_t *filename, AVType type,
 
 /* Variable "fmt_short_name" is used to determine muxers/demuxers. */
 extern bool AVInfo_open_input(AVInfo *av_info, char *fmt_short_name);
-extern bool AVInfo_open_bmp(AVInfo *av_info);
 extern bool AVInfo_open_wav(AVInfo *av_info);
 extern bool AVInfo_open_video(AVInfo *av_info, char *fmt_short_name);
 
+/**
+ * Open the video encoder "codec_ctx2" with "av_info -> width", "av_info -> height" and 
+ * "av_info -> vfr". Used by "AVInfo_open_video" and "AVInfo_open_segment".
+ * libx264 is tuned for still images with a long GOP; the key frames are forced at the
+ * beginning of every image by "encode_image".
+ */
+extern bool AVInfo_open_video_encoder(AVInfo *av_info, bool global_header);
+
+/**
+ * Open a video encoder with the same settings as "video_info" but without output file.
+ * The packets it gives out are kept in "av_info -> pending" to be written to "video_info" later.
+ */
+extern bool AVInfo_open_segment(AVInfo *av_info, AVInfo *video_info);
+
 /* Clear original data and open the file again. */
 extern void AVInfo_reopen_input(AVInfo *av_info);
 
-/* Create a temporary bmp file in order to preview images in "partition_audio". */
-extern bool AVInfo_create_bmp(AVInfo *av_info);
+/**
+ * Scale the image to fit the preview window of "partition_audio", into "preview" in BGRA 
+ * pixel format. This function can be called by several threads for different images.
+ */
+extern bool AVInfo_create_preview(AVInfo *av_info, AVFrame *preview);
+
+/**
+ * Decoded images are as large as the image files, which is several hundred megabytes for 
+ * scans at high resolution, and each worker thread decodes one. The memory they take at the 
+ * same time is kept under "vs_config.decode_memory" by making the threads wait. The image
+ * decoders of FFmpeg return whole pictures, so feeding swscale in slices would not make them
+ * smaller; the budget bounds how many of them are held instead. Images kept by the source 
+ * cache count too, and are dropped before a thread waits.
+ */
+typedef struct DecodeBudget
+{
+	int64_t in_use;  /* bytes */
+	int64_t cached;  /* bytes of "in_use" kept by the source cache */
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE released;
+} DecodeBudget;
+extern DecodeBudget decode_budget;
+
+/* Call it once when the program starts. */
+extern void decode_budget_init();
+extern void decode_budget_free();
+/* The size of the decoded image of "image_info" in bytes, estimated from the header. */
+extern int64_t decoded_size(AVInfo *image_info);
+/**
+ * Wait until "bytes" fits in the budget and take it. A single image larger than the budget 
+ * is let through when nothing else is decoded.
+ */
+extern void reserve_decode_memory(int64_t bytes);
+extern void release_decode_memory(int64_t bytes);
+/* Hand "reserved" bytes of a decoded image over to the source cache, which keeps "bytes" of it. */
+extern void cache_decode_memory(int64_t reserved, int64_t bytes);
+/* Give back "bytes" of an image dropped by the source cache. */
+extern void uncache_decode_memory(int64_t bytes);
+
+#define SOURCE_CACHE_LIMIT 1024  /* maximum number of decoded images kept */
+
+/**
+ * Decoded images are kept in memory, so that the previews of "partition_audio", the check of 
+ * "detect_gray" and every export scale them to their own sizes without decoding them again. 
+ * The least recently used image is dropped when they take more than "vs_config.source_cache" 
+ * megabytes; it is decoded again when needed.
+ */
+typedef struct SourceCache
+{
+	AVInfo *entries[SOURCE_CACHE_LIMIT];
+	int nb_entries;
+	int64_t in_use;  /* bytes */
+	int64_t clock;
+	int hits, misses;
+	CRITICAL_SECTION lock;
+} SourceCache;
+extern SourceCache source_cache;
+
+/* Call it once when the program starts, and free it after every AVInfo. */
+extern void source_cache_init();
+extern void source_cache_free();
+
+/**
+ * Put the decoded image of "image_info" in "image_info -> frame", taken from the source cache
+ * or decoded and kept there. Decoding takes its size from the decode budget. Return false on 
+ * failure. Call "release_source" when the frame is not needed any more.
+ */
+extern bool decode_source(AVInfo *image_info);
+/* Unref the frame and packet of "decode_source" and give back what it took from the budget. */
+extern void release_source(AVInfo *image_info);
+/**
+ * Drop the least recently used images until "bytes" more fit in "vs_config.source_cache".
+ * Called with 0 when the option changes.
+ */
+extern void source_cache_shrink(int64_t bytes);
+/* Drop the least recently used image, if any. */
+extern void source_cache_drop_oldest();
+/* Drop entry "index"; the caller holds "source_cache.lock". */
+extern void source_cache_drop(int index);
+/* Drop the decoded image of "image_info" from the source cache. */
+extern void source_cache_remove(AVInfo *image_info);
 
 /* Create a temporary wav file for audition in "partition_audio". */
 extern bool AVInfo_create_wav(AVInfo *av_info);
 
-/* Put the frame "src" in the center of "dest". */
-extern void put_frame_to_center(AVFrame *dest, AVFrame *src);
+/**
+ * Fill "frame" in RGBA, YUV420P or GRAY8 pixel format outside the rectangle of size "width" x 
+ * "height" whose top left corner is ("x_min", "y_min"). In YUV420P "x_min" and "y_min" must be even.
+ */
+extern void fill_letterbox(AVFrame *frame, int x_min, int y_min, int width, int height);
+
+/**
+ * The swscale flags of "quality" for scaling "src_w" x "src_h" to "dst_w" x "dst_h". Pixel
+ * format conversion at the same size takes bilinear filtering except for the draft tier.
+ */
+extern int scaler_flags(VSQuality quality, int src_w, int src_h, int dst_w, int dst_h);
+/* The name of a quality tier used by the command "config". */
+extern const wchar_t *quality_name(VSQuality quality);
+
+/**
+ * Decode the image and set "image_info -> gray" if none of its pixels has color, within 
+ * GRAY_TOLERANCE. Pixel formats which are not 8-bit are taken as colored. 
+ */
+extern bool detect_gray(AVInfo *image_info);
+
+/**
+  * Decode and convert "image_info -> packet" to "frame" in pixel format "format", which is
+  * RGBA, YUV420P or GRAY8, scaled with "quality". Variable "width" and "height" are the width and 
+  * height of the frame. The decoded image is freed before returning, within the decode budget.
+  */
+extern bool decode_image(AVInfo *image_info, AVFrame *frame, int width, int height,
+                         enum AVPixelFormat format, VSQuality quality);
+/**
+ * The size "scaled_w" x "scaled_h" of a "src_w" x "src_h" image fitted into a "width" x "height"
+ * frame. Returns true if the image is only padded, in which case it keeps its size.
+ */
+extern bool fit_image(int src_w, int src_h, int width, int height, int *scaled_w, int *scaled_h);
+extern bool decode_and_scale(AVInfo *image_info, AVFrame *frame, int width, int height,
+                             enum AVPixelFormat format, VSQuality quality);
 
 /**
-  * Decode and convert "image_info -> packet" to "frame" in RGBA pixel format.
-  * Variable "width" and "height" are the width and height of the frame.
+  * Decode a background image to "bg_info -> rendered" at the size "width" x "height" unless
+  * it is already there, and make "bg_frame" refer to it. Pages sharing the background image 
+  * blend with the same frame. In GRAY8 pixel format the frame is "bg_info -> rendered_gray".
   */
-extern bool decode_image(AVInfo *image_info, AVFrame *frame, int width, int height);
+extern bool render_background(AVInfo *bg_info, int width, int height,
+                              enum AVPixelFormat format, VSQuality quality, AVFrame *bg_frame);
+/**
+ * Count a composition which blended "bg_info". The rendered frames are freed after the last 
+ * counted one; a later composition renders them again.
+ */
+extern void release_background(AVInfo *bg_info);
 
 /**
-  * Mix images on "frame1", and convert to YUV420P pixel format on frame2.
-  * Variable "pos" is the position of the image in the image track.
+  * Mix the background images "bg_info[bg_list[0]]" to "bg_info[bg_list[nb_bg - 1]]" on 
+  * "frame1", and convert to YUV420P pixel format on frame2. If "frame1" is already in 
+  * YUV420P, the background images are blended on its planes and frame2 refers to it.
+  * If "frame1" is in GRAY8, the background images must be gray and blended in GRAY8.
   */
-extern bool mix_images(AVInfo *image_info, AVInfo **bg_info, AVFrame *frame1,
-                       AVFrame *frame2, int pos, int bg_count);
+extern bool mix_images(AVInfo **bg_info, int *bg_list, int nb_bg, AVFrame *frame1, AVFrame *frame2,
+                       VSQuality quality);
+/* Convert "gray" in GRAY8 pixel format to "yuv" in YUV420P: the luma follows, the chroma is neutral. */
+extern void gray_to_yuv(AVFrame *gray, AVFrame *yuv);
+
+/**
+ * Encode "video_info -> frame2" for "nb_ticks" ticks of the time base of the video codec,
+ * beginning at tick "begin_pts".
+ * For constant frame rate a tick is a frame. If "video_info -> copy_frames" is true, the 
+ * frame is encoded only once as a key frame and once as a P-frame; the rest of the frames 
+ * are copies of these packets.
+ * For variable frame rate a frame is written every "VFR_keyframe_interval" seconds and lasts
+ * until the next one.
+ * The encoder may keep several frames in flight, so the packets are written later when they
+ * come out of the encoder. Call "flush_image_encoder" after the last image.
+ */
+extern bool encode_image(AVInfo *video_info, int64_t begin_pts, int64_t nb_ticks, EncodedImage *cache_entry);
+
+/**
+ * Encode an image of copied packets lasting more than 2 ticks. The P-frame is encoded from 
+ * the key frame as decoded, so that nothing is left to code, and it is decoded to check that 
+ * it shows the key frame unchanged; otherwise each copy would add its residual again. If it 
+ * does not, every frame of the image is encoded. "image" is the last one in "video_info -> pending".
+ */
+extern bool encode_still_image(AVInfo *video_info, PendingImage *image);
+/* Decode "packet" with "video_info -> codec_ctx3" to "frame". */
+extern bool decode_video_packet(AVInfo *video_info, AVPacket *packet, AVFrame *frame);
+/* Whether two frames in YUV420P pixel format of the same size have the same pixels. */
+extern bool same_yuv_frames(AVFrame *frame1, AVFrame *frame2);
+/* Replace the last image in "video_info -> pending" with "image". */
+extern void replace_last_pending(AVInfo *video_info, PendingImage *image);
 
-/* Encode and write "video_info -> frame" "nb_frames" times. */
-extern bool encode_image(AVInfo *video_info, int64_t begin_pts, int nb_frames);
+/* Write the packets of "encoded" instead of encoding the image again. */
+extern bool reuse_image(AVInfo *video_info, EncodedImage *encoded, int64_t begin_pts, 
+                        int64_t nb_ticks, EncodedImage *cache_entry);
+
+/* Whether the packets of "encoded" can be written for an image lasting "nb_ticks" ticks. */
+extern bool can_reuse_image(AVInfo *video_info, EncodedImage *encoded, int64_t nb_ticks);
+
+/**
+ * Whether an image encoded by another encoder may follow an image lasting "prev_ticks" ticks; 
+ * 0 for nothing before. H.264 numbers the IDR pictures of each encoder from 0 (idr_pic_id), 
+ * and two adjacent IDR pictures must have different numbers. An image of a single packet 
+ * ends with its IDR picture, so it can not be followed by an IDR picture of another encoder.
+ */
+extern bool can_join_images(AVInfo *video_info, int64_t prev_ticks);
+
+/* The number of ticks between two frames of an image written by "write_image_packets". */
+extern int64_t image_frame_step(AVInfo *video_info);
+
+/* The number of packets the encoder gives out for an image lasting "nb_ticks" ticks. */
+extern int image_packet_count(AVInfo *video_info, int64_t nb_ticks);
+
+extern AVPacket **packet_array_alloc(int nb_packets);
+extern void packet_array_free(AVPacket ***packets, int nb_packets);
+
+/**
+ * Keep a reference to the packets of "image" in "image -> cache_entry". Call it before 
+ * "write_image_packets", which moves the packets to the muxer.
+ */
+extern void keep_image_packets(PendingImage *image);
+
+/* Send "video_info -> frame2" to the video encoder, and receive all available packets. */
+extern bool send_image_frame(AVInfo *video_info);
+extern bool send_video_frame(AVInfo *video_info, AVFrame *frame);
+extern bool receive_image_packets(AVInfo *video_info);
+
+/**
+ * Write the packets of pending images at the head of "video_info -> pending" which are all received.
+ * Nothing is written if "video_info" has no output file (see "AVInfo_open_segment").
+ */
+extern bool write_pending_images(AVInfo *video_info);
+extern bool image_received(PendingImage *image);
+extern bool write_image_packets(AVInfo *video_info, PendingImage *image);
+
+/* Drain the video encoder and write the rest of the pending images. */
+extern bool flush_image_encoder(AVInfo *video_info);
+
+/**
+ * Check if the exported video file can be played: it can be demuxed, the first video packet 
+ * is a key frame, timestamps are strictly increasing and every packet can be decoded.
+ * Variable "duration" is the expected duration in seconds.
+ */
+extern bool check_video(char *filename_utf8, double duration);
+
+/**
+ * Write a packet to the output file, interleaved by dts with the packets of other streams.
+ * The packet is taken by the muxer. This function can be called by several threads.
+ */
+extern bool write_packet(AVInfo *video_info, AVPacket *packet);
 
 /* Write blank data to audio track. */
 extern bool write_blank_audio(AVInfo *video_info, int64_t begin_pts, int nb_frames);
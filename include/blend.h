@@ -0,0 +1,71 @@
+/**
+ * VisualScores header file: blend.h
+ * Declares functions which blend background images with images in RGBA, YUV420P or GRAY8 pixel format.
+ */
+
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdint.h>
+#include <wchar.h>
+
+#include <libavutil/frame.h>
+
+typedef enum BlendMode
+{
+	BLEND_DARKEN,    /* the darker of the two colors; white parts of both images disappear */
+	BLEND_MULTIPLY,  /* the product of the two colors */
+	BLEND_OVER       /* the image over the background image, weighted by the alpha of the image */
+} BlendMode;
+
+/**
+ * Blend "width" pixels of the background image "bg" into "dest". The alpha channel of "dest"
+ * is kept except for BLEND_OVER, which gives the alpha of the composited pixels.
+ */
+typedef void (*BlendFunction)(uint8_t *dest, const uint8_t *bg, int width);
+
+/**
+ * Choose the fastest implementation of "mode" the processor supports (AVX2, SSE2 or scalar).
+ * The vectorized functions give exactly the same results as the scalar ones.
+ */
+extern BlendFunction get_blend_function(BlendMode mode);
+
+/* scalar implementations, also the reference of the others */
+extern void blend_darken_c(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_multiply_c(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_over_c(uint8_t *dest, const uint8_t *bg, int width);
+
+#if defined(__x86_64__) || defined(__i386__)
+extern void blend_darken_sse2(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_multiply_sse2(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_over_sse2(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_darken_avx2(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_multiply_avx2(uint8_t *dest, const uint8_t *bg, int width);
+extern void blend_over_avx2(uint8_t *dest, const uint8_t *bg, int width);
+#endif
+
+/**
+ * Blend the planes of the background image "bg" into "dest", both in YUV420P pixel format with
+ * limited range. Darken keeps the darker luma and takes the chroma of the darker 2x2 block;
+ * multiply multiplies the luma and adds the chroma offsets, which is exact for gray pixels.
+ * BLEND_OVER is not supported since the planes carry no alpha.
+ */
+extern void blend_planes(AVFrame *dest, const AVFrame *bg, BlendMode mode);
+
+/* Blend "width" luma samples of "bg" into "dest". */
+extern BlendFunction get_luma_blend_function(BlendMode mode);
+/* Blend "width" samples of "bg" into "dest", both in GRAY8 pixel format with full range. */
+extern BlendFunction get_gray_blend_function(BlendMode mode);
+extern void gray_multiply_c(uint8_t *dest, const uint8_t *bg, int width);
+extern void luma_darken_c(uint8_t *dest, const uint8_t *bg, int width);
+extern void luma_multiply_c(uint8_t *dest, const uint8_t *bg, int width);
+
+#if defined(__x86_64__) || defined(__i386__)
+extern void luma_darken_sse2(uint8_t *dest, const uint8_t *bg, int width);
+extern void luma_darken_avx2(uint8_t *dest, const uint8_t *bg, int width);
+#endif
+
+/* The name of a blend mode used by the command "blend". */
+extern const wchar_t *blend_mode_name(BlendMode mode);
+
+#endif /* BLEND_H */
@@ -0,0 +1,115 @@
+/** 
+ * VisualScores header file: converter.h
+ * Declares the cache of image scalers, audio resamplers and frame buffers shared by the whole program.
+ */
+
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+
+#define CONVERTER_LIMIT 32  /* maximum number of cached scalers, and of cached resamplers */
+#define FRAME_POOL_LIMIT 8  /* maximum number of frame pools; the least recently used is dropped */
+
+typedef struct ScalerKey
+{
+	int src_w, src_h, src_fmt;
+	int dst_w, dst_h, dst_fmt;
+	int flags;
+	int threads;
+} ScalerKey;
+
+typedef struct ResamplerKey
+{
+	int src_channels, src_fmt, src_rate;
+	int dst_channels, dst_fmt, dst_rate;
+} ResamplerKey;
+
+typedef struct CachedScaler
+{
+	ScalerKey key;
+	struct SwsContext *sws_ctx;
+	bool in_use;  /* a context is used by one thread at a time */
+} CachedScaler;
+
+typedef struct CachedResampler
+{
+	ResamplerKey key;
+	struct SwrContext *swr_ctx;
+	bool in_use;
+} CachedResampler;
+
+/* buffers of one pixel format and size, e.g. the pages of an export */
+typedef struct FramePool
+{
+	int format, width, height;
+	int size;
+	int linesize[4];
+	AVBufferPool *pool;
+	int64_t last_used;
+} FramePool;
+
+/**
+ * Building a scaler computes its filter coefficients, which is slow for Lanczos, so the 
+ * contexts are kept for the whole program and reused whenever the same conversion is needed.
+ */
+typedef struct ConverterCache
+{
+	CachedScaler scalers[CONVERTER_LIMIT];
+	int nb_scalers;
+	CachedResampler resamplers[CONVERTER_LIMIT];
+	int nb_resamplers;
+	FramePool frame_pools[FRAME_POOL_LIMIT];
+	int nb_frame_pools;
+	int64_t frame_pool_clock;
+
+	int scaler_hits, scaler_misses;
+	int resampler_hits, resampler_misses;
+	CRITICAL_SECTION lock;
+} ConverterCache;
+extern ConverterCache converter_cache;
+
+/* Call it once when the program starts. */
+extern void converter_cache_init();
+extern void converter_cache_free();
+
+/**
+ * Take a scaler from the cache, or create one if every cached scaler of the conversion is 
+ * used by other threads. Return NULL on failure. Give it back with "release_scaler".
+ * A scaler with "threads" other than 1 splits its output into horizontal bands scaled on 
+ * its own threads; 0 for one thread per core.
+ */
+extern struct SwsContext *acquire_scaler(int src_w, int src_h, int src_fmt,
+                                         int dst_w, int dst_h, int dst_fmt, int flags, int threads);
+extern void release_scaler(struct SwsContext *sws_ctx);
+
+/**
+ * Scale "src" into the rectangle of "frame" whose planes begin at "dest", at the output size
+ * of "sws_ctx". Unlike "sws_scale", this uses the threads of the scaler.
+ */
+extern bool scale_into_frame(struct SwsContext *sws_ctx, const AVFrame *src, AVFrame *frame, uint8_t **dest);
+
+/**
+ * Take an initialized resampler from the cache, or create one. Return NULL on failure.
+ * A resampler is reusable only if it is flushed; otherwise pass false to "release_resampler"
+ * and it is freed.
+ */
+extern struct SwrContext *acquire_resampler(AVChannelLayout *src_layout, int src_fmt, int src_rate,
+                                            AVChannelLayout *dst_layout, int dst_fmt, int dst_rate);
+extern void release_resampler(struct SwrContext *swr_ctx, bool reusable);
+
+/**
+ * Give "frame" a buffer of "format" at "width" x "height" taken from the pool of that size, 
+ * instead of allocating a new one with "av_frame_get_buffer". The buffer goes back to the 
+ * pool when the frame is unreferenced. Its content is not initialized. Return false on failure.
+ */
+extern bool get_pooled_buffer(AVFrame *frame, enum AVPixelFormat format, int width, int height);
+
+#endif /* CONVERTER_H */
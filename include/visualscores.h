@@ -15,6 +15,12 @@
 
 #define FILE_LIMIT 300  /* maximum number of files in each track */
 #define TIME_LIMIT 10000  /* maximum length of the video file */
+#define QUEUE_DEPTH 8  /* maximum number of composed frames waiting for the video encoder */
+#define HASH_SEED 0xCBF29CE484222325ULL  /* offset basis of FNV-1a */
+#define WORKER_LIMIT 64  /* maximum number of threads composing frames or encoding segments */
+#define SEGMENT_QUEUE_DEPTH 8  /* maximum number of encoded images of a segment waiting to be joined */
+#define DRAFT_WIDTH 640  /* width of the video file exported by "export draft" */
+#define MEMORY_SAMPLE_INTERVAL 5  /* milliseconds between samples of the working set during export */
 
 /**
  * ALWAYS NOTICE THAT THE INDEX OF USER INPUT AND TAG STARTS FROM 1, BUT THE
@@ -40,10 +46,112 @@ typedef struct VisualScores
 	 */
 	int *image_pos;
 
+	/**
+	 * Packets of the images encoded by the last export, by position in the image track. 
+	 * Images whose file, background images and encoder settings are unchanged are not 
+	 * encoded again by the next export. NULL before the first export. Drafts have their
+	 * own cache, which is freed after the draft.
+	 */
+	EncodedImage *encoded;
+
+	/**
+	 * Range index of the background track, built by "build_bg_index" for each export. 
+	 * The background images of the image at "pos" are "bg_list[bg_offset[pos]]" to
+	 * "bg_list[bg_offset[pos + 1] - 1]".
+	 */
+	int *bg_offset;
+	int *bg_list;
+
+	bool draft;  /* whether the export in progress is a draft; see "export_video" */
+
 } VisualScores;
 
+/**
+ * Images are decoded and mixed with background images by worker threads while the main 
+ * thread encodes. Entries of "rec_index" whose position appears for the first time are jobs;
+ * at most QUEUE_DEPTH of them are composed but not yet taken by the encoder. Composed frames
+ * are kept by position until the last appearance of the position, so repeated images are
+ * composed only once.
+ */
+typedef struct ExportPipeline
+{
+	VisualScores *vs;
+	int *rec_index;
+	int jobs[FILE_LIMIT];        /* entries of "rec_index" to compose */
+	int nb_jobs;
+	int next_job;                /* next job to be claimed by a worker */
+	int next_taken;              /* next job to be taken by the encoder */
+	int in_flight;               /* jobs claimed by workers but not taken by the encoder */
+	AVFrame *composed[FILE_LIMIT];  /* composed frames by position in the image track */
+	int remaining[FILE_LIMIT];      /* remaining appearances of each position */
+	bool failed;
+	bool stopped;
+
+	HANDLE workers[WORKER_LIMIT];
+	int nb_workers;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE frame_ready;
+	CONDITION_VARIABLE slot_free;
+} ExportPipeline;
+
+/**
+ * The previews shown by "partition_audio" are rendered in memory by worker threads in the 
+ * order they are shown, so the first one can be shown as soon as it is ready while the rest 
+ * are still rendered.
+ */
+typedef struct PreviewStore
+{
+	VisualScores *vs;
+	int jobs[FILE_LIMIT];           /* indices of image files, in the order they are shown */
+	int nb_jobs;
+	int next_job;                   /* next job to be claimed by a worker */
+	AVFrame *previews[FILE_LIMIT];  /* rendered previews by index of image file */
+	bool failed;
+	bool stopped;
+
+	HANDLE workers[WORKER_LIMIT];
+	int nb_workers;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE preview_ready;
+} PreviewStore;
+
+/**
+ * The entries "begin" to "end - 1" of "rec_index" are composed and encoded by one thread with
+ * its own encoder. Every image begins with a key frame, so the packets of the segments are
+ * joined by stream copy in the order of the segments. The encoded images are handed to the 
+ * main thread through "queue", and the encoder waits while it is full, so a segment does 
+ * not hold its packets in memory until its turn comes.
+ */
+typedef struct ExportSegment
+{
+	VisualScores *vs;
+	int *rec_index;
+	int64_t *begin_ticks;   /* see "fill_ticks" */
+	EncodedImage **reuse;   /* see "prepare_encoded_images" */
+	int begin;
+	int end;
+	AVInfo *encoder_info;   /* opened by "AVInfo_open_segment" */
+	AVFifo *queue;          /* PendingImage whose packets are all received, up to SEGMENT_QUEUE_DEPTH */
+	bool finished;          /* whether the encoder has handed over every image */
+	bool succeeded;
+	bool stopped;           /* set by the main thread when the export fails */
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+} ExportSegment;
+
+/**
+ * The peak working set reported by Windows covers the whole life of the program, including
+ * earlier exports, so the working set is sampled by a thread while the tracks are written.
+ */
+typedef struct MemoryMonitor
+{
+	HANDLE thread;
+	HANDLE stop;   /* event which ends the sampling */
+	size_t peak;   /* largest working set sampled, in bytes */
+} MemoryMonitor;
+
 /* name of commands and corrsponding functions */
-#define COMMAND_COUNT 15
+#define COMMAND_COUNT 18
 extern const wchar_t short_command[COMMAND_COUNT][5];
 extern const wchar_t long_command[COMMAND_COUNT][10];
 extern void (*functions[COMMAND_COUNT]) (VisualScores *, wchar_t *);
@@ -61,6 +169,18 @@ extern void switch_language(VisualScores *vs, wchar_t *cmd);
 extern void quit(VisualScores *vs, wchar_t *cmd);
 extern void settings(VisualScores *vs, wchar_t *cmd);
 
+/* Show or set export options. */
+extern void config(VisualScores *vs, wchar_t *cmd);
+extern bool config_parse_input(VisualScores *vs, wchar_t *cmd, wchar_t *option, wchar_t *value);
+extern bool parse_switch(wchar_t *value, bool *result);
+extern bool parse_quality(wchar_t *value, VSQuality *result);
+/* Parse "auto", a height followed by "p" or a width. */
+extern bool parse_resolution(wchar_t *value, int *width, int *height);
+extern bool parse_thread_count(wchar_t *value, int *result);
+/* Parse an integer from "min" to "max". */
+extern bool parse_integer(wchar_t *value, int min, int max, int *result);
+extern void print_config();
+
 /**
  * Used in partition and video export. Records the correct indices of image files after 
  * repeating to 'rec_index' and returns the size of 'rec_index'.
@@ -103,6 +223,10 @@ extern bool set_repetition_parse_input(VisualScores *vs, wchar_t *cmd, int *begi
 extern void set_duration(VisualScores *vs, wchar_t *cmd);
 extern bool set_duration_parse_input(VisualScores *vs, wchar_t *cmd, int *index, double *time);
 
+/* Set the blend mode of a background image. */
+extern void set_blend_mode(VisualScores *vs, wchar_t *cmd);
+extern bool set_blend_mode_parse_input(VisualScores *vs, wchar_t *cmd, int *index, BlendMode *mode);
+
 #define ID_ENTER 1
 #define ID_ESCAPE 2
 
@@ -113,13 +237,24 @@ extern bool partition_audio_parse_input(VisualScores *vs, wchar_t *cmd, int *ind
 /* Sets the duration of each image file from rec_duration. */
 extern void register_duration(VisualScores *vs, int total_partition, int *rec_index, double *rec_duration);
 
+/* Start rendering the previews of the images of the first "size" entries of "rec_index". */
+extern PreviewStore *preview_start(VisualScores *vs, int *rec_index, int size);
+extern unsigned __stdcall preview_worker(void *arg);
+/**
+ * Wait until the preview of image file "index" is rendered and return a bitmap of it, which 
+ * the caller deletes. Return NULL if a preview failed to render.
+ */
+extern HBITMAP preview_take(PreviewStore *store, int index);
+/* Stop the worker threads and free the previews. */
+extern void preview_stop(PreviewStore *store);
+
 /* event processing functions */
 extern void do_painting(HWND hWnd, HBITMAP *hBitmap);
 /* This function returns true if we want to exit the message loop. */
-extern bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, VisualScores *vs, AVInfo *audio_info, 
-                          int *partition_count, int total_partition, int *rec_index, 
+extern bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, PreviewStore *store, VisualScores *vs, 
+                          AVInfo *audio_info, int *partition_count, int total_partition, int *rec_index, 
                           clock_t *begin_time, clock_t *prev_time, double *rec_duration);
-extern void escape_pressed(HWND hWnd, HBITMAP *hBitmap);
+extern void escape_pressed(HWND hWnd, HBITMAP *hBitmap, PreviewStore *store);
 
 /* Discard the partition done to an audio file. */
 extern void discard_partition(VisualScores *vs, wchar_t *cmd);
@@ -127,9 +262,131 @@ extern void discard_partition(VisualScores *vs, wchar_t *cmd);
 /* Determine the filename of the video file from the argument [Path] specified by user input. */
 extern void get_video_filename(wchar_t *dest, wchar_t *src);
 
-/* Export the video file. */
+/**
+ * Export the video file. "export draft [Path]" exports a small video file with the same 
+ * timing as fast as possible, for checking the timing before the final export.
+ */
 extern void export_video(VisualScores *vs, wchar_t *cmd);
+extern void write_video(VisualScores *vs, wchar_t *cmd);
+/**
+ * The size of the video file: the largest image scaled to a width from 1280 to 1920 or to the
+ * resolution set by the command "config", or to DRAFT_WIDTH for a draft.
+ */
+extern void get_video_size(VisualScores *vs, int *video_w, int *video_h);
 extern bool write_image_track(VisualScores *vs);
+/* Build the range index of the background track and clear the rendered background images. */
+extern void build_bg_index(VisualScores *vs);
+/**
+ * Count the compositions of the entries of "rec_index" that blend each background image, so 
+ * that its rendered frames are freed after the last one instead of at the end of the image 
+ * track. Each segment composes its positions on its own, so it is counted on its own.
+ */
+extern void count_background_uses(VisualScores *vs, int *rec_index, EncodedImage **reuse, int size);
+/* Free the background images rendered by the export. */
+extern void release_backgrounds(VisualScores *vs);
+
+/* Start sampling the working set of the program into "monitor -> peak". */
+extern void memory_monitor_start(MemoryMonitor *monitor);
+extern unsigned __stdcall memory_monitor_worker(void *arg);
+/* Stop sampling and return the largest working set in bytes. */
+extern size_t memory_monitor_stop(MemoryMonitor *monitor);
+
+/* Print the average bitrate of each image written by the last export. */
+extern void print_bitrates(VisualScores *vs);
+
+/**
+ * Time the quality tiers of the scaler on the loaded images and compare them with Lanczos,
+ * then time Lanczos and the video encoder on different numbers of threads, and the per-frame
+ * cost of writing packets.
+ */
+extern void benchmark(VisualScores *vs, wchar_t *cmd);
+/**
+ * Scale the decoded image "src" to "frame" in RGBA pixel format at its size fitted into "width" x 
+ * "height", and add the time of scaling to "seconds", without the setup of the scaler. The 
+ * frame is not letterboxed.
+ */
+extern bool time_scaling(AVFrame *src, AVFrame *frame, int width, int height, VSQuality quality, double *seconds);
+/* The sum of squared differences of the color channels of two frames in RGBA pixel format. */
+extern double frame_squared_error(AVFrame *frame1, AVFrame *frame2);
+
+/**
+ * Encode each of "frames" as "frames_per_image" frames, the first one a key frame, and drain 
+ * the encoder of "encoder_info". The packets are dropped.
+ */
+extern bool encode_frames(AVInfo *encoder_info, AVFrame **frames, int nb_images, int frames_per_image);
+
+/**
+ * The time in nanoseconds per frame to hand the copied packets of still images to the muxer: 
+ * with a new packet, a new reference and rescaled timestamps for each frame as before, or as 
+ * "write_image_packets" does with "reuse": one packet which takes a reference for each copy, 
+ * the packet of the image moved for its last frame, and timestamps added up.
+ */
+extern double packet_overhead(bool reuse, int nb_packets);
+
+/**
+ * Fill "begin_ticks" with the first tick of each entry of "rec_index" in the time base of
+ * the video codec; "begin_ticks[size]" is the end of the image track.
+ */
+extern void fill_ticks(VisualScores *vs, int *rec_index, int size, int64_t *begin_ticks);
+
+/* Write the image track by the main thread with worker threads composing images. */
+extern bool write_image_sequence(VisualScores *vs, int *rec_index, int64_t *begin_ticks, 
+                                 EncodedImage **reuse, int size);
+
+/**
+ * Replace "vs -> encoded" with an empty cache for the current export and return the old one.
+ * "reuse[i]" is set to the packets of the last export which the entry "i" of "rec_index" 
+ * can reuse, or NULL if the image needs encoding.
+ */
+extern EncodedImage *prepare_encoded_images(VisualScores *vs, int *rec_index, int64_t *begin_ticks,
+                                            int size, EncodedImage **reuse);
+/* The length in ticks of the last image before entry "index" that lasts any ticks; 0 for none. */
+extern int64_t ticks_written_before(int64_t *begin_ticks, int index);
+/* Hash the image file, background images and encoder settings of position "pos"; 0 on failure. */
+extern uint64_t image_cache_key(VisualScores *vs, int pos, uint64_t *bg_hash);
+extern EncodedImage *find_encoded_image(EncodedImage *encoded, uint64_t key);
+extern void free_encoded_images(EncodedImage *encoded);
+extern uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+/**
+ * Hash the file of an image or background image to "image_info -> content_hash". If it has
+ * changed since the last call, the decoded image is dropped and "detect_gray" is run again.
+ */
+extern void refresh_image(AVInfo *image_info);
+/* Hash the content of a file; 0 if the file can not be read. */
+extern uint64_t hash_file(wchar_t *filename);
+
+/* Write the image track by "nb_segments" threads, each encoding a contiguous part of "rec_index". */
+extern bool write_segments(VisualScores *vs, int *rec_index, int64_t *begin_ticks, 
+                           EncodedImage **reuse, int size, int nb_segments);
+/* Free the queue and the encoder of "segment". */
+extern void segment_free(ExportSegment *segment);
+extern unsigned __stdcall segment_worker(void *arg);
+extern bool encode_segment(ExportSegment *segment);
+/**
+ * Move the images at the head of the pending images of the encoder of "segment" whose packets
+ * are all received to "segment -> queue", waiting while it is full. Return false if stopped.
+ */
+extern bool hand_over_images(ExportSegment *segment);
+/* Write the images of "segment" to "video_info" as the encoder hands them over. */
+extern bool write_segment(AVInfo *video_info, ExportSegment *segment);
+
+/* Decode the image at position "pos" of the image track and mix it with background images. */
+extern AVFrame *compose_image(VisualScores *vs, int pos);
+/**
+ * Whether the image at position "pos" is gray and has only gray background images blended 
+ * without alpha. Such images are composed in GRAY8 pixel format.
+ */
+extern bool can_compose_gray(VisualScores *vs, int pos);
+
+/* Start worker threads composing the images of "rec_index" which are not reused. */
+extern ExportPipeline *pipeline_start(VisualScores *vs, int *rec_index, EncodedImage **reuse, int size);
+extern unsigned __stdcall pipeline_worker(void *arg);
+/* Wait for the composed frame of the entry "index" of "rec_index" and put a reference in "frame". */
+extern bool pipeline_take(ExportPipeline *pipeline, int index, AVFrame *frame);
+/* Stop the worker threads and free the pipeline. */
+extern void pipeline_stop(ExportPipeline *pipeline);
 extern bool write_audio_track(VisualScores *vs);
+/* Thread procedure of "write_audio_track"; the exit code is 1 on success and 0 on failure. */
+extern unsigned __stdcall audio_track_worker(void *arg);
 
 #endif /* VISUALSCORES_H */
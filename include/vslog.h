@@ -9,7 +9,7 @@
 #include <stdbool.h>
 
 /* Note that here we have added 1 to the actual number of tags. */
-#define VS_LOG_COUNT 57
+#define VS_LOG_COUNT 85
 #define STRING_LIMIT 300  /* maximum length of a string */
 
 typedef enum Language
@@ -37,7 +37,11 @@ typedef enum VS_log_tag
 	SETTINGS_DURATION_SET,
 	SETTINGS_DURATION,
 	BEGIN_AND_END,
+	BEGIN_END_AND_BLEND,
 	SETTINGS_REPETITION,
+	CONFIG_HEAD,
+	CONFIG_OPTION,
+	CONFIG_SET,
 	
 	FILE_LIMIT_EXCEEDED,
 	FILE_LIMIT_EXCEEDED2,
@@ -60,12 +64,13 @@ typedef enum VS_log_tag
 	REPETITION_SET,
 	CAN_NOT_SET_DURATION,
 	DURATION_SET,
+	BLEND_MODE_SET,
 
 	AUDIO_NOT_LOADED,
 	ALL_AUDIO_PARTITIONED,
 	NEED_NO_PARTITION,
-	CREATING_BMP,
-	FAILED_TO_CREATE_BMP,
+	CREATING_PREVIEWS,
+	FAILED_TO_CREATE_PREVIEWS,
 	CREATING_WAV,
 	FAILED_TO_CREATE_WAV,
 	FAILED_TO_DISPLAY,
@@ -78,10 +83,33 @@ typedef enum VS_log_tag
 	
 	DURATION_NOT_SET,
 	TIME_LIMIT_EXCEEDED,
+	DRAFT_EXPORT,
+	IMAGES_REUSED,
 	WRITING_IMAGE_TRACK,
 	WRITING_AUDIO_TRACK,
 	FAILED_TO_EXPORT,
-	VIDEO_EXPORTED
+	VFR_NOT_SUPPORTED,
+	H264_NOT_AVAILABLE,
+	MPEG4_SLICE_THREADS,
+	YUV_COMPOSITE_NOT_SUPPORTED,
+	PLAYBACK_CHECK_FAILED,
+	BITRATE_HEAD,
+	BITRATE_OF_IMAGE,
+	BITRATE_TOTAL,
+	TIME_ELAPSED,
+	PEAK_MEMORY,
+	CONVERTER_CACHE_STATS,
+	SOURCE_CACHE_STATS,
+	VIDEO_EXPORTED,
+	BENCHMARK_HEAD,
+	BENCHMARK_REFERENCE,
+	BENCHMARK_TIER,
+	BENCHMARK_THREADS_HEAD,
+	BENCHMARK_THREADS,
+	BENCHMARK_PACKETS,
+	BENCHMARK_ENCODER_HEAD,
+	BENCHMARK_ENCODER,
+	BENCHMARK_FAILED
 } VS_log_tag;
 
 extern const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT];
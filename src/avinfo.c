@@ -12,6 +12,7 @@
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/opt.h>
 
 #include "avinfo.h"
 #include "vslog.h"
@@ -22,6 +23,31 @@ const int WAV_samplerate = 44100;
 const int MP3_framesize = 1152;
 const int AAC_framesize = 1024;
 const int WAV_framesize = 1024;
+const int VFR_timebase = 1000;
+const double VFR_keyframe_interval = 5.0;
+const int MPEG4_gop_size = 10;
+const int H264_gop_size = 250;
+
+VSConfig vs_config = {
+	.codec = VSCODEC_AUTO,
+	.vfr = false,
+	.qscale = 3,   /* sharp enough for black notes on white paper */
+	.crf = 20,
+	.threads = 0,
+	.thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME,
+	.workers = 0,
+	.segments = 1,
+	.composite = VSCOMPOSITE_RGBA,
+	.quality = VSQUALITY_HIGH,
+	.preview_quality = VSQUALITY_STANDARD,  /* previews are only shown on the screen */
+	.draft_backgrounds = false,
+	.scaler_threads = 1,  /* images are already composed in parallel by workers */
+	.video_width = 0,
+	.video_height = 0,
+	.gray_pages = true,
+	.decode_memory = 1024,
+	.source_cache = 1024
+};
 
 AVInfo *AVInfo_init()
 {
@@ -38,22 +64,41 @@ AVInfo *AVInfo_init()
 	av_info -> codec_ctx2 = NULL;
 	av_info -> packet = NULL;
 	av_info -> frame = NULL;
+	av_info -> packet2 = NULL;
+	av_info -> packet3 = NULL;
+	av_info -> frame2 = NULL;
+	av_info -> codec_ctx3 = NULL;
+	av_info -> frame3 = NULL;
+	av_info -> hold_pending = false;
+	av_info -> rendered = NULL;
+	av_info -> rendered_gray = NULL;
+	av_info -> bg_uses = 0;
+	av_info -> decoded = NULL;
+	av_info -> decoded_used = 0;
+	av_info -> reserved = 0;
+	av_info -> consumed = false;
 
 	av_info -> nb_repetition = 0;
 	av_info -> duration = malloc(sizeof(double) * REPETITION_LIMIT);
 	av_info -> duration[0] = 3.0;
 	av_info -> partitioned = false;
+	av_info -> blend = BLEND_DARKEN;
+	av_info -> gray = false;
+	av_info -> content_hash = 0;
+	av_info -> vfr = false;
+	av_info -> copy_frames = true;
+	av_info -> compose_fmt = AV_PIX_FMT_RGBA;
+	av_info -> pending = NULL;
+	InitializeCriticalSection(&av_info -> lock);
 	av_info -> filename = malloc(sizeof(wchar_t) * STRING_LIMIT);
-	av_info -> bmp_filename = malloc(sizeof(wchar_t) * STRING_LIMIT);
 	av_info -> filename_utf8 = malloc(sizeof(wchar_t) * STRING_LIMIT);
-	av_info -> bmp_filename_utf8 = malloc(sizeof(wchar_t) * STRING_LIMIT);
 
 	return av_info;
 }
 
 void AVInfo_free(AVInfo *av_info)
 {
-	if(av_info -> fmt_ctx -> pb != NULL)
+	if(av_info -> fmt_ctx != NULL && av_info -> fmt_ctx -> pb != NULL)
 		avio_closep(&av_info -> fmt_ctx -> pb);
 	switch(av_info -> type)
 	{
@@ -63,7 +108,6 @@ void AVInfo_free(AVInfo *av_info)
 			if(av_info -> fmt_ctx != NULL)
 				avformat_close_input(&av_info -> fmt_ctx);
 			break;
-		case AVTYPE_BMP:
 		case AVTYPE_WAV:
 		case AVTYPE_VIDEO:
 			if(av_info -> fmt_ctx != NULL)
@@ -74,14 +118,32 @@ void AVInfo_free(AVInfo *av_info)
 		avcodec_free_context(&av_info -> codec_ctx);
 	if(av_info -> codec_ctx2 != NULL)
 		avcodec_free_context(&av_info -> codec_ctx2);
+	if(av_info -> codec_ctx3 != NULL)
+		avcodec_free_context(&av_info -> codec_ctx3);
 	av_packet_free(&av_info -> packet);
 	av_frame_free(&av_info -> frame);
+	av_packet_free(&av_info -> packet2);
+	av_packet_free(&av_info -> packet3);
+	av_frame_free(&av_info -> frame2);
+	av_frame_free(&av_info -> frame3);
+	av_frame_free(&av_info -> rendered);
+	av_frame_free(&av_info -> rendered_gray);
+	source_cache_remove(av_info);
+
+	if(av_info -> pending != NULL)
+	{
+		PendingImage image;
+		while(av_fifo_read(av_info -> pending, &image, 1) >= 0)
+		{
+			packet_array_free(&image.packets, image.nb_packets);
+		}
+		av_fifo_freep2(&av_info -> pending);
+	}
 	
+	DeleteCriticalSection(&av_info -> lock);
 	free(av_info -> duration);
 	free(av_info -> filename);
-	free(av_info -> bmp_filename);
 	free(av_info -> filename_utf8);
-	free(av_info -> bmp_filename_utf8);
 	free(av_info);
 }
 
@@ -106,25 +168,6 @@ bool AVInfo_open(AVInfo *av_info, wchar_t *filename, AVType type,
 		strcat_s(fmt_short_name, 10, "_pipe");
 
 	av_info -> type = type;
-	switch(type)
-	{
-		case AVTYPE_IMAGE:
-		{
-			wchar_t *pwc = wcsrchr(av_info -> filename, L'\\');
-			swprintf_s(av_info -> bmp_filename, STRING_LIMIT, L"resource\\_display_%ls.bmp", pwc + 1);
-			int size = WideCharToMultiByte(CP_UTF8, 0, av_info -> bmp_filename, -1, NULL, 0, NULL, NULL);
-			WideCharToMultiByte(CP_UTF8, 0, av_info -> bmp_filename, -1, av_info -> bmp_filename_utf8, size, NULL, NULL);
-			break;
-		}
-		case AVTYPE_BMP:
-		{
-			wcscpy_s(av_info -> bmp_filename, STRING_LIMIT, filename);
-			int size = WideCharToMultiByte(CP_UTF8, 0, av_info -> bmp_filename, -1, NULL, 0, NULL, NULL);
-			WideCharToMultiByte(CP_UTF8, 0, av_info -> bmp_filename, -1, av_info -> bmp_filename_utf8, size, NULL, NULL);
-			break;
-		}
-	}
-
 	switch(type)
 	{
 		case AVTYPE_AUDIO:
@@ -133,7 +176,6 @@ bool AVInfo_open(AVInfo *av_info, wchar_t *filename, AVType type,
 			av_info -> end = end;
 			break;
 
-		case AVTYPE_BMP:
 		case AVTYPE_VIDEO:
 			av_info -> width = width;
 			av_info -> height = height;
@@ -155,9 +197,6 @@ bool AVInfo_open(AVInfo *av_info, wchar_t *filename, AVType type,
 			}
 			break;
 		}
-		case AVTYPE_BMP:
-			ret = AVInfo_open_bmp(av_info);
-			break;
 		case AVTYPE_WAV:
 			ret = AVInfo_open_wav(av_info);
 			break;
@@ -247,98 +286,6 @@ bool AVInfo_open_input(AVInfo *av_info, char *fmt_short_name)
 	return true;
 }
 
-bool AVInfo_open_bmp(AVInfo *av_info)
-{
-	avformat_alloc_output_context2(&av_info -> fmt_ctx, NULL, NULL, av_info -> filename_utf8);
-	if(!av_info -> fmt_ctx)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-
-	av_info -> fmt_ctx -> url = av_strdup(av_info -> filename_utf8);
-	av_info -> fmt_ctx -> oformat = av_guess_format(NULL, av_info -> filename_utf8, NULL);
-	if(!av_info -> fmt_ctx -> oformat)
-	{
-		avformat_free_context(av_info -> fmt_ctx);
-		return false;
-	}
-   
-	if(!avformat_new_stream(av_info -> fmt_ctx, NULL))
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-   
-	const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_BMP);
-	if(!encoder)
-	{
-		avformat_free_context(av_info -> fmt_ctx);
-		return false;
-	}
-
-	av_info -> codec_ctx = avcodec_alloc_context3(encoder);
-	if(!av_info -> codec_ctx)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-
-	av_info -> codec_ctx -> width  = av_info -> width;
-	av_info -> codec_ctx -> height = av_info -> height;
-	av_info -> codec_ctx -> sample_aspect_ratio = (AVRational){1, 1};   
-	av_info -> codec_ctx -> pix_fmt = AV_PIX_FMT_BGRA;
-	av_info -> codec_ctx -> time_base = (AVRational){1, (int)VS_framerate};
-	av_info -> fmt_ctx -> streams[0] -> time_base = av_info -> codec_ctx -> time_base;
-	if(av_info -> fmt_ctx -> oformat -> flags & AVFMT_GLOBALHEADER)
-		av_info -> codec_ctx -> flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-	if(avcodec_open2(av_info -> codec_ctx, encoder, NULL) < 0)
-	{
-    	avcodec_free_context(&av_info -> codec_ctx);
-		avformat_free_context(av_info -> fmt_ctx);
-		return false;
-	}
-
-	if(avcodec_parameters_from_context(av_info -> fmt_ctx -> streams[0] -> codecpar, av_info -> codec_ctx) < 0)
-	{
-    	avcodec_free_context(&av_info -> codec_ctx);
-		avformat_free_context(av_info -> fmt_ctx);
-		return false;
-	}
-
-  	av_info -> packet = av_packet_alloc();
-	if(!av_info -> packet)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-	
-	av_info -> frame = av_frame_alloc();
-	if(!av_info -> frame)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-
-	av_info -> frame -> format = AV_PIX_FMT_BGRA;
-	av_info -> frame -> width  = av_info -> codec_ctx -> width;
-	av_info -> frame -> height = av_info -> codec_ctx -> height;
-	if(av_frame_get_buffer(av_info -> frame, 32) < 0)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-	
-   return true;
-}
-
 bool AVInfo_open_wav(AVInfo *av_info)
 {
 	avformat_alloc_output_context2(&av_info -> fmt_ctx, NULL, NULL, av_info -> filename_utf8);
@@ -501,58 +448,43 @@ bool AVInfo_open_video(AVInfo *av_info, char *fmt_short_name)
 	}
 	audio_stream -> time_base = av_info -> codec_ctx -> time_base;
 
-	const AVCodec *encoder2 = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
-	if(!encoder2)
+	/* avi files can not store timestamps of frames with variable duration */
+	av_info -> vfr = (vs_config.vfr && strcmp(fmt_short_name, "avi") != 0);
+	if(!AVInfo_open_video_encoder(av_info, av_info -> fmt_ctx -> oformat -> flags & AVFMT_GLOBALHEADER))
 	{
 		avcodec_free_context(&av_info -> codec_ctx);
 		avformat_free_context(av_info -> fmt_ctx);
 		return false;
 	}
 
-	av_info -> codec_ctx2 = avcodec_alloc_context3(encoder2);
-	if(!av_info -> codec_ctx2)
+	AVStream *video_stream = avformat_new_stream(av_info -> fmt_ctx, av_info -> codec_ctx2 -> codec);
+	if(!video_stream)
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
 
-	av_info -> codec_ctx2 -> width  = av_info -> width;
-	av_info -> codec_ctx2 -> height = av_info -> height;
-	av_info -> codec_ctx2 -> sample_aspect_ratio = (AVRational){1, 1};
-	av_info -> codec_ctx2 -> pix_fmt = AV_PIX_FMT_YUV420P;
-	av_info -> codec_ctx2 -> time_base = (AVRational){1, (int)VS_framerate};
-	av_info -> codec_ctx2 -> framerate = (AVRational){(int)VS_framerate, 1};
-	av_info -> codec_ctx2 -> max_b_frames = 0;
-	av_info -> codec_ctx2 -> gop_size = 10;
-	if(av_info -> fmt_ctx -> oformat -> flags & AVFMT_GLOBALHEADER)
-		av_info -> codec_ctx2 -> flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-	if(avcodec_open2(av_info -> codec_ctx2, encoder2, NULL) < 0)
+	if(avcodec_parameters_from_context(video_stream -> codecpar, av_info -> codec_ctx2) < 0)
 	{
 		avcodec_free_context(&av_info -> codec_ctx);
 		avcodec_free_context(&av_info -> codec_ctx2);
 		avformat_free_context(av_info -> fmt_ctx);
 		return false;
 	}
+	video_stream -> time_base = av_info -> codec_ctx2 -> time_base;
 
-	AVStream *video_stream = avformat_new_stream(av_info -> fmt_ctx, encoder2);
-	if(!video_stream)
+	av_info -> pending = av_fifo_alloc2(16, sizeof(PendingImage), AV_FIFO_FLAG_AUTO_GROW);
+	av_info -> packet2 = av_packet_alloc();
+	av_info -> packet3 = av_packet_alloc();
+	av_info -> frame2 = av_frame_alloc();
+	if(!av_info -> pending || !av_info -> packet2 || !av_info -> packet3 || !av_info -> frame2)
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
 
-	if(avcodec_parameters_from_context(video_stream -> codecpar, av_info -> codec_ctx2) < 0)
-	{
-		avcodec_free_context(&av_info -> codec_ctx);
-		avcodec_free_context(&av_info -> codec_ctx2);
-		avformat_free_context(av_info -> fmt_ctx);
-		return false;
-	}
-	video_stream -> time_base = av_info -> codec_ctx2 -> time_base;
-
 	av_info -> packet = av_packet_alloc();
 	if(!av_info -> packet)
 	{
@@ -572,10 +504,134 @@ bool AVInfo_open_video(AVInfo *av_info, char *fmt_short_name)
 	return true;
 }
 
+bool AVInfo_open_video_encoder(AVInfo *av_info, bool global_header)
+{
+	const AVCodec *encoder = NULL;
+	if(vs_config.codec != VSCODEC_MPEG4)
+		encoder = avcodec_find_encoder_by_name("libx264");
+	if(!encoder)
+		encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+	if(!encoder)
+		return false;
+	/* H.264 numbers the frames in the bitstream, so its packets can not be copied. */
+	av_info -> copy_frames = (encoder -> id == AV_CODEC_ID_MPEG4);
+
+	av_info -> codec_ctx2 = avcodec_alloc_context3(encoder);
+	if(!av_info -> codec_ctx2)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	av_info -> codec_ctx2 -> width  = av_info -> width;
+	av_info -> codec_ctx2 -> height = av_info -> height;
+	av_info -> codec_ctx2 -> sample_aspect_ratio = (AVRational){1, 1};
+	av_info -> codec_ctx2 -> pix_fmt = AV_PIX_FMT_YUV420P;
+	if(av_info -> vfr)
+		av_info -> codec_ctx2 -> time_base = (AVRational){1, VFR_timebase};
+	else
+	{
+		av_info -> codec_ctx2 -> time_base = (AVRational){1, (int)VS_framerate};
+		av_info -> codec_ctx2 -> framerate = (AVRational){(int)VS_framerate, 1};
+	}
+	av_info -> codec_ctx2 -> max_b_frames = 0;
+	/* constant quality: the size of a page depends on how much is printed on it */
+	if(av_info -> copy_frames)
+	{
+		av_info -> codec_ctx2 -> gop_size = MPEG4_gop_size;
+		av_info -> codec_ctx2 -> flags |= AV_CODEC_FLAG_QSCALE;
+		av_info -> codec_ctx2 -> global_quality = FF_QP2LAMBDA * vs_config.qscale;
+	}
+	else
+	{
+		av_info -> codec_ctx2 -> gop_size = H264_gop_size;
+		av_opt_set_int(av_info -> codec_ctx2 -> priv_data, "crf", vs_config.crf, 0);
+		av_opt_set(av_info -> codec_ctx2 -> priv_data, "tune", "stillimage", 0);
+		av_opt_set(av_info -> codec_ctx2 -> priv_data, "forced-idr", "1", 0);
+	}
+	av_info -> codec_ctx2 -> thread_count = vs_config.threads;
+	/* The MPEG-4 encoder has slice threads only, which it would not use with "threading frame". */
+	av_info -> codec_ctx2 -> thread_type = vs_config.thread_type | (av_info -> copy_frames ? FF_THREAD_SLICE : 0);
+	if(global_header)
+		av_info -> codec_ctx2 -> flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if(avcodec_open2(av_info -> codec_ctx2, encoder, NULL) < 0)
+	{
+		avcodec_free_context(&av_info -> codec_ctx2);
+		return false;
+	}
+
+	/* The P-frames of still images are decoded to check them; see "encode_still_image". */
+	if(av_info -> copy_frames)
+	{
+		av_info -> frame3 = av_frame_alloc();
+		if(!av_info -> frame3)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		const AVCodec *decoder = avcodec_find_decoder(AV_CODEC_ID_MPEG4);
+		if(decoder)
+			av_info -> codec_ctx3 = avcodec_alloc_context3(decoder);
+		if(av_info -> codec_ctx3)
+		{
+			/* without it every image is encoded frame by frame */
+			AVCodecContext *codec_ctx3 = av_info -> codec_ctx3;
+			codec_ctx3 -> width = av_info -> codec_ctx2 -> width;
+			codec_ctx3 -> height = av_info -> codec_ctx2 -> height;
+			codec_ctx3 -> thread_count = 1;
+			if(av_info -> codec_ctx2 -> extradata_size > 0)
+			{
+				codec_ctx3 -> extradata = av_mallocz(av_info -> codec_ctx2 -> extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+				if(!codec_ctx3 -> extradata)
+				{
+					VS_print_log(INSUFFICIENT_MEMORY);
+					system("pause >nul 2>&1");
+					abort();
+				}
+				memcpy(codec_ctx3 -> extradata, av_info -> codec_ctx2 -> extradata, av_info -> codec_ctx2 -> extradata_size);
+				codec_ctx3 -> extradata_size = av_info -> codec_ctx2 -> extradata_size;
+			}
+			if(avcodec_open2(codec_ctx3, decoder, NULL) < 0)
+				avcodec_free_context(&av_info -> codec_ctx3);
+		}
+	}
+	return true;
+}
+
+bool AVInfo_open_segment(AVInfo *av_info, AVInfo *video_info)
+{
+	av_info -> type = AVTYPE_VIDEO;
+	av_info -> width = video_info -> width;
+	av_info -> height = video_info -> height;
+	av_info -> vfr = video_info -> vfr;
+	if(!AVInfo_open_video_encoder(av_info, video_info -> codec_ctx2 -> flags & AV_CODEC_FLAG_GLOBAL_HEADER))
+		return false;
+
+	av_info -> pending = av_fifo_alloc2(16, sizeof(PendingImage), AV_FIFO_FLAG_AUTO_GROW);
+	av_info -> packet2 = av_packet_alloc();
+	av_info -> frame2 = av_frame_alloc();
+	if(!av_info -> pending || !av_info -> packet2 || !av_info -> frame2)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	return true;
+}
+
 void AVInfo_reopen_input(AVInfo *av_info)
 {
-	if(av_info -> type == AVTYPE_BMP || av_info -> type == AVTYPE_WAV || av_info -> type == AVTYPE_VIDEO)
+	if(av_info -> type == AVTYPE_WAV || av_info -> type == AVTYPE_VIDEO)
 		return;
+	/* An image taken from the source cache has left the input as it was opened. */
+	if((av_info -> type == AVTYPE_IMAGE || av_info -> type == AVTYPE_BG_IMAGE) && !av_info -> consumed)
+	{
+		av_frame_unref(av_info -> frame);
+		return;
+	}
 	
 	avformat_close_input(&av_info -> fmt_ctx);
 	avcodec_free_context(&av_info -> codec_ctx);
@@ -597,4 +653,5 @@ void AVInfo_reopen_input(AVInfo *av_info)
 		height = av_info -> height;
 	}
 	AVInfo_open(av_info, av_info -> filename, av_info -> type, begin, end, width, height);
+	av_info -> consumed = false;
 }
@@ -0,0 +1,346 @@
+/** 
+ * VisualScores source file: blend.c
+ * Defines functions which blend background images with images in RGBA, YUV420P or GRAY8 pixel format.
+ */
+
+#include <stdint.h>
+#include <wchar.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "blend.h"
+
+/* x / 255 rounded to the nearest integer, exact for 0 <= x <= 255 * 255 */
+#define DIV255(x)  (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+/* limits of luma and the neutral chroma of limited range */
+#define LUMA_MIN     16
+#define LUMA_MAX     235
+#define CHROMA_ZERO  128
+
+BlendFunction get_blend_function(BlendMode mode)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	int cpu_flags = av_get_cpu_flags();
+	if(cpu_flags & AV_CPU_FLAG_AVX2)
+	{
+		switch(mode)
+		{
+			case BLEND_DARKEN:    return blend_darken_avx2;
+			case BLEND_MULTIPLY:  return blend_multiply_avx2;
+			case BLEND_OVER:      return blend_over_avx2;
+		}
+	}
+	if(cpu_flags & AV_CPU_FLAG_SSE2)
+	{
+		switch(mode)
+		{
+			case BLEND_DARKEN:    return blend_darken_sse2;
+			case BLEND_MULTIPLY:  return blend_multiply_sse2;
+			case BLEND_OVER:      return blend_over_sse2;
+		}
+	}
+#endif
+	switch(mode)
+	{
+		case BLEND_MULTIPLY:  return blend_multiply_c;
+		case BLEND_OVER:      return blend_over_c;
+		default:              return blend_darken_c;
+	}
+}
+
+BlendFunction get_luma_blend_function(BlendMode mode)
+{
+	if(mode == BLEND_MULTIPLY)
+		return luma_multiply_c;
+
+#if defined(__x86_64__) || defined(__i386__)
+	int cpu_flags = av_get_cpu_flags();
+	if(cpu_flags & AV_CPU_FLAG_AVX2)
+		return luma_darken_avx2;
+	if(cpu_flags & AV_CPU_FLAG_SSE2)
+		return luma_darken_sse2;
+#endif
+	return luma_darken_c;
+}
+
+BlendFunction get_gray_blend_function(BlendMode mode)
+{
+	/* Darken is the same on any range. */
+	if(mode == BLEND_MULTIPLY)
+		return gray_multiply_c;
+	return get_luma_blend_function(BLEND_DARKEN);
+}
+
+void blend_planes(AVFrame *dest, const AVFrame *bg, BlendMode mode)
+{
+	/* The chroma is blended first since darken compares the luma before blending. */
+	int chroma_w = (dest -> width + 1) / 2;
+	int chroma_h = (dest -> height + 1) / 2;
+	for(int y = 0; y < chroma_h; ++y)
+	{
+		int y2 = (2 * y + 1 < dest -> height ? 2 * y + 1 : 2 * y);
+		const uint8_t *dest_luma[2] = {dest -> data[0] + 2 * y * dest -> linesize[0],
+		                               dest -> data[0] + y2 * dest -> linesize[0]};
+		const uint8_t *bg_luma[2] = {bg -> data[0] + 2 * y * bg -> linesize[0],
+		                             bg -> data[0] + y2 * bg -> linesize[0]};
+		for(int c = 1; c <= 2; ++c)
+		{
+			uint8_t *dest_row = dest -> data[c] + y * dest -> linesize[c];
+			const uint8_t *bg_row = bg -> data[c] + y * bg -> linesize[c];
+			for(int x = 0; x < chroma_w; ++x)
+			{
+				if(mode == BLEND_MULTIPLY)
+				{
+					int value = dest_row[x] + bg_row[x] - CHROMA_ZERO;
+					dest_row[x] = (value < 0 ? 0 : (value > 255 ? 255 : value));
+					continue;
+				}
+
+				int x2 = (2 * x + 1 < dest -> width ? 2 * x + 1 : 2 * x);
+				int dest_sum = dest_luma[0][2 * x] + dest_luma[0][x2] + dest_luma[1][2 * x] + dest_luma[1][x2];
+				int bg_sum = bg_luma[0][2 * x] + bg_luma[0][x2] + bg_luma[1][2 * x] + bg_luma[1][x2];
+				if(bg_sum < dest_sum)
+					dest_row[x] = bg_row[x];
+			}
+		}
+	}
+
+	BlendFunction blend = get_luma_blend_function(mode);
+	for(int y = 0; y < dest -> height; ++y)
+		blend(dest -> data[0] + y * dest -> linesize[0], bg -> data[0] + y * bg -> linesize[0], dest -> width);
+}
+
+void luma_darken_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	for(int x = 0; x < width; ++x)
+		if(dest[x] > bg[x])
+			dest[x] = bg[x];
+}
+
+void luma_multiply_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	/* (d - 16) * (b - 16) / 219 + 16, rounded */
+	const int range = LUMA_MAX - LUMA_MIN;
+	for(int x = 0; x < width; ++x)
+	{
+		int d = (dest[x] < LUMA_MIN ? 0 : (dest[x] > LUMA_MAX ? range : dest[x] - LUMA_MIN));
+		int b = (bg[x] < LUMA_MIN ? 0 : (bg[x] > LUMA_MAX ? range : bg[x] - LUMA_MIN));
+		dest[x] = LUMA_MIN + (d * b + range / 2) / range;
+	}
+}
+
+void gray_multiply_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	for(int x = 0; x < width; ++x)
+		dest[x] = DIV255(dest[x] * bg[x]);
+}
+
+const wchar_t *blend_mode_name(BlendMode mode)
+{
+	switch(mode)
+	{
+		case BLEND_MULTIPLY:  return L"multiply";
+		case BLEND_OVER:      return L"over";
+		default:              return L"darken";
+	}
+}
+
+void blend_darken_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	for(int x = 0; x < width; ++x)
+	{
+		/* skip alpha channels */
+		for(int c = 0; c < 3; ++c)
+			if(dest[4 * x + c] > bg[4 * x + c])
+				dest[4 * x + c] = bg[4 * x + c];
+	}
+}
+
+void blend_multiply_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	for(int x = 0; x < width; ++x)
+	{
+		for(int c = 0; c < 3; ++c)
+			dest[4 * x + c] = DIV255(dest[4 * x + c] * bg[4 * x + c]);
+	}
+}
+
+void blend_over_c(uint8_t *dest, const uint8_t *bg, int width)
+{
+	for(int x = 0; x < width; ++x)
+	{
+		int alpha = dest[4 * x + 3];
+		for(int c = 0; c < 3; ++c)
+			dest[4 * x + c] = DIV255(dest[4 * x + c] * alpha + bg[4 * x + c] * (255 - alpha));
+		dest[4 * x + 3] = alpha + DIV255(bg[4 * x + 3] * (255 - alpha));
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * The vectorized functions work on 4 (SSE2) or 8 (AVX2) pixels at a time; the rest of a
+ * row is left to the scalar functions. Products are computed on 16-bit lanes.
+ */
+
+/* DIV255 on 16-bit lanes */
+#define DIV255_SSE2(x)  _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16((x), _mm_set1_epi16(128)), \
+                        _mm_srli_epi16(_mm_add_epi16((x), _mm_set1_epi16(128)), 8)), 8)
+#define DIV255_AVX2(x)  _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16((x), _mm256_set1_epi16(128)), \
+                        _mm256_srli_epi16(_mm256_add_epi16((x), _mm256_set1_epi16(128)), 8)), 8)
+
+__attribute__((target("sse2")))
+void blend_darken_sse2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+	int x = 0;
+	for(; x + 4 <= width; x += 4)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dest + 4 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(bg + 4 * x));
+		__m128i r = _mm_or_si128(_mm_andnot_si128(alpha_mask, _mm_min_epu8(d, b)), 
+		                         _mm_and_si128(alpha_mask, d));
+		_mm_storeu_si128((__m128i *)(dest + 4 * x), r);
+	}
+	blend_darken_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+void blend_multiply_sse2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for(; x + 4 <= width; x += 4)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dest + 4 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(bg + 4 * x));
+		__m128i lo = DIV255_SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(b, zero)));
+		__m128i hi = DIV255_SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(b, zero)));
+		__m128i r = _mm_or_si128(_mm_andnot_si128(alpha_mask, _mm_packus_epi16(lo, hi)), 
+		                         _mm_and_si128(alpha_mask, d));
+		_mm_storeu_si128((__m128i *)(dest + 4 * x), r);
+	}
+	blend_multiply_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+void blend_over_sse2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m128i alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+	for(; x + 4 <= width; x += 4)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dest + 4 * x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(bg + 4 * x));
+		__m128i dh[2] = {_mm_unpacklo_epi8(d, zero), _mm_unpackhi_epi8(d, zero)};
+		__m128i bh[2] = {_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero)};
+		for(int h = 0; h < 2; ++h)
+		{
+			/* two pixels in 16-bit lanes; the alpha is broadcast to all channels */
+			__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(dh[h], 0xFF), 0xFF);
+			__m128i bg_part = _mm_mullo_epi16(bh[h], _mm_sub_epi16(_mm_set1_epi16(255), alpha));
+			__m128i color = DIV255_SSE2(_mm_add_epi16(_mm_mullo_epi16(dh[h], alpha), bg_part));
+			__m128i new_alpha = _mm_add_epi16(alpha, DIV255_SSE2(bg_part));
+			dh[h] = _mm_or_si128(_mm_andnot_si128(alpha_mask, color), _mm_and_si128(alpha_mask, new_alpha));
+		}
+		_mm_storeu_si128((__m128i *)(dest + 4 * x), _mm_packus_epi16(dh[0], dh[1]));
+	}
+	blend_over_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+void luma_darken_sse2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	int x = 0;
+	for(; x + 16 <= width; x += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dest + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(bg + x));
+		_mm_storeu_si128((__m128i *)(dest + x), _mm_min_epu8(d, b));
+	}
+	luma_darken_c(dest + x, bg + x, width - x);
+}
+
+__attribute__((target("avx2")))
+void blend_darken_avx2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+	int x = 0;
+	for(; x + 8 <= width; x += 8)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dest + 4 * x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(bg + 4 * x));
+		__m256i r = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, _mm256_min_epu8(d, b)), 
+		                            _mm256_and_si256(alpha_mask, d));
+		_mm256_storeu_si256((__m256i *)(dest + 4 * x), r);
+	}
+	blend_darken_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void blend_multiply_avx2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+	const __m256i zero = _mm256_setzero_si256();
+	int x = 0;
+	for(; x + 8 <= width; x += 8)
+	{
+		/* unpack and pack work inside each 128-bit lane, so the pixels stay in order */
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dest + 4 * x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(bg + 4 * x));
+		__m256i lo = DIV255_AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(b, zero)));
+		__m256i hi = DIV255_AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(b, zero)));
+		__m256i r = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, _mm256_packus_epi16(lo, hi)), 
+		                            _mm256_and_si256(alpha_mask, d));
+		_mm256_storeu_si256((__m256i *)(dest + 4 * x), r);
+	}
+	blend_multiply_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void blend_over_avx2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	const __m256i alpha_mask = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+	const __m256i zero = _mm256_setzero_si256();
+	int x = 0;
+	for(; x + 8 <= width; x += 8)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dest + 4 * x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(bg + 4 * x));
+		__m256i dh[2] = {_mm256_unpacklo_epi8(d, zero), _mm256_unpackhi_epi8(d, zero)};
+		__m256i bh[2] = {_mm256_unpacklo_epi8(b, zero), _mm256_unpackhi_epi8(b, zero)};
+		for(int h = 0; h < 2; ++h)
+		{
+			__m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(dh[h], 0xFF), 0xFF);
+			__m256i bg_part = _mm256_mullo_epi16(bh[h], _mm256_sub_epi16(_mm256_set1_epi16(255), alpha));
+			__m256i color = DIV255_AVX2(_mm256_add_epi16(_mm256_mullo_epi16(dh[h], alpha), bg_part));
+			__m256i new_alpha = _mm256_add_epi16(alpha, DIV255_AVX2(bg_part));
+			dh[h] = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, color), _mm256_and_si256(alpha_mask, new_alpha));
+		}
+		_mm256_storeu_si256((__m256i *)(dest + 4 * x), _mm256_packus_epi16(dh[0], dh[1]));
+	}
+	blend_over_c(dest + 4 * x, bg + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void luma_darken_avx2(uint8_t *dest, const uint8_t *bg, int width)
+{
+	int x = 0;
+	for(; x + 32 <= width; x += 32)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dest + x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(bg + x));
+		_mm256_storeu_si256((__m256i *)(dest + x), _mm256_min_epu8(d, b));
+	}
+	luma_darken_c(dest + x, bg + x, width - x);
+}
+
+#endif
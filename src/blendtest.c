@@ -0,0 +1,111 @@
+/**
+ * VisualScores source file: blendtest.c
+ * Checks that the vectorized blend functions give exactly the same results as the scalar ones.
+ * Built by "make blendtest"; it returns 0 when every function matches.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/cpu.h>
+
+#include "blend.h"
+
+#define TEST_WIDTH 300   /* widths from 0 to TEST_WIDTH - 1 pixels are tested */
+#define TEST_ROUNDS 20   /* random rows of each width */
+
+typedef struct BlendTest
+{
+	const char *name;
+	BlendFunction reference;
+	BlendFunction tested;
+	int bytes_per_pixel;  /* 4 for RGBA, 1 for luma */
+	int cpu_flag;
+} BlendTest;
+
+/**
+ * Blend random rows of every width with "test -> tested" and "test -> reference", at every
+ * alignment within 32 bytes, and compare the results byte by byte. The bytes after the row
+ * must be left as they are.
+ */
+bool run_blend_test(const BlendTest *test)
+{
+	int size = TEST_WIDTH * test -> bytes_per_pixel + 64;
+	uint8_t *dest = malloc(size), *expected = malloc(size), *bg = malloc(size);
+	if(!dest || !expected || !bg)
+	{
+		printf("Insufficient memory.\n");
+		exit(1);
+	}
+
+	bool ret = true;
+	for(int width = 0; width < TEST_WIDTH && ret; ++width)
+		for(int round = 0; round < TEST_ROUNDS && ret; ++round)
+		{
+			int offset = round % 32;
+			for(int i = 0; i < size; ++i)
+			{
+				/* extreme values are more likely than in uniform noise */
+				int r = rand();
+				dest[i] = (r % 8 == 0 ? 0 : r % 8 == 1 ? 255 : (r >> 3) & 0xFF);
+				bg[i] = (rand() >> 3) & 0xFF;
+			}
+			memcpy(expected, dest, size);
+
+			test -> reference(expected + offset, bg + offset, width);
+			test -> tested(dest + offset, bg + offset, width);
+			if(memcmp(dest, expected, size) != 0)
+			{
+				int i = 0;
+				while(dest[i] == expected[i])
+					++i;
+				printf("%s: mismatch at width %d, alignment %d, byte %d: %d instead of %d\n",
+				       test -> name, width, offset, i - offset, dest[i], expected[i]);
+				ret = false;
+			}
+		}
+
+	free(dest);
+	free(expected);
+	free(bg);
+	return ret;
+}
+
+int main()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	const BlendTest tests[] = {
+		{"blend_darken_sse2",   blend_darken_c,   blend_darken_sse2,   4, AV_CPU_FLAG_SSE2},
+		{"blend_multiply_sse2", blend_multiply_c, blend_multiply_sse2, 4, AV_CPU_FLAG_SSE2},
+		{"blend_over_sse2",     blend_over_c,     blend_over_sse2,     4, AV_CPU_FLAG_SSE2},
+		{"luma_darken_sse2",    luma_darken_c,    luma_darken_sse2,    1, AV_CPU_FLAG_SSE2},
+		{"blend_darken_avx2",   blend_darken_c,   blend_darken_avx2,   4, AV_CPU_FLAG_AVX2},
+		{"blend_multiply_avx2", blend_multiply_c, blend_multiply_avx2, 4, AV_CPU_FLAG_AVX2},
+		{"blend_over_avx2",     blend_over_c,     blend_over_avx2,     4, AV_CPU_FLAG_AVX2},
+		{"luma_darken_avx2",    luma_darken_c,    luma_darken_avx2,    1, AV_CPU_FLAG_AVX2}
+	};
+	int nb_tests = sizeof(tests) / sizeof(tests[0]);
+
+	srand(1);
+	int cpu_flags = av_get_cpu_flags();
+	int nb_failed = 0;
+	for(int i = 0; i < nb_tests; ++i)
+	{
+		if(!(cpu_flags & tests[i].cpu_flag))
+		{
+			printf("%s: skipped, not supported by the processor\n", tests[i].name);
+			continue;
+		}
+		if(run_blend_test(&tests[i]))
+			printf("%s: passed\n", tests[i].name);
+		else  ++nb_failed;
+	}
+	return (nb_failed > 0);
+#else
+	printf("No vectorized blend functions on this processor.\n");
+	return 0;
+#endif
+}
@@ -3,21 +3,27 @@
  * Defines functions mainly dealing with format conversion.
  */
 
+#include <math.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/file.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
 #include "avinfo.h"
+#include "converter.h"
 #include "vslog.h"
 
-bool AVInfo_create_bmp(AVInfo *av_info)
+bool AVInfo_create_preview(AVInfo *av_info, AVFrame *preview)
 {
 	int screen_w = GetSystemMetrics(SM_CXSCREEN);
 	int display_window_w = screen_w * 0.45;
@@ -25,123 +31,41 @@ bool AVInfo_create_bmp(AVInfo *av_info)
 	double scaling_w = (double) display_window_w / av_info -> width;
 	double scaling_h = (double) display_window_h / av_info -> height;
 	double scaling = ((scaling_w < scaling_h) ? scaling_w: scaling_h);
-	int width  = av_info -> width * scaling;
-	int height = av_info -> height * scaling;
+	int width  = FFMAX(1, av_info -> width * scaling);
+	int height = FFMAX(1, av_info -> height * scaling);
 
-	AVInfo* bmp_info = AVInfo_init();
-	if(!AVInfo_open(bmp_info, av_info -> bmp_filename, AVTYPE_BMP, -1, -1, width, height))
+	if(!decode_source(av_info))
 	{
-		free(bmp_info);
-		return false;
-	}
-
-	if(avformat_write_header(bmp_info -> fmt_ctx, NULL) < 0)
-	{
-		AVInfo_free(bmp_info);
+		AVInfo_reopen_input(av_info);
 		return false;
 	}
 
-	struct SwsContext *sws_ctx = sws_alloc_context();
-	if(!sws_ctx)
+	preview -> format = AV_PIX_FMT_BGRA;
+	preview -> width  = width;
+	preview -> height = height;
+	if(av_frame_get_buffer(preview, 0) < 0)
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
-	
-	if(av_read_frame(av_info -> fmt_ctx, av_info -> packet) < 0)
-	{
-		AVInfo_free(bmp_info);
-		AVInfo_reopen_input(av_info);
-		return false;
-	}
-
-	while(true)
-	{
-		int ret1 = avcodec_send_packet(av_info -> codec_ctx, av_info -> packet) < 0;
-		if(ret1 < 0 && ret1 != AVERROR(EAGAIN) && ret1 != AVERROR_EOF)
-		{
-			AVInfo_free(bmp_info);
-			AVInfo_reopen_input(av_info);
-			return false;
-		}
-
-		int ret2 = avcodec_receive_frame(av_info -> codec_ctx, av_info -> frame);
-		if(ret2 == AVERROR(EAGAIN))
-			continue;
-		else if(ret2 == AVERROR_EOF || ret2 == 0)
-			break;
-		else if(ret2 < 0)
-		{
-			AVInfo_free(bmp_info);
-			AVInfo_reopen_input(av_info);
-			return false;
-		}
-	}
-	
-	sws_ctx = sws_getCachedContext(sws_ctx, av_info -> frame -> width, av_info -> frame -> height,
-	                               (enum AVPixelFormat)av_info -> frame -> format,
-	                               bmp_info -> width, bmp_info -> height,
-	                               AV_PIX_FMT_BGRA, SWS_LANCZOS, 0, 0, 0);
-	if(!sws_ctx)
-	{
-		AVInfo_free(bmp_info);
-		AVInfo_reopen_input(av_info);
-		return false;
-	}
-
-	sws_scale(sws_ctx, (const uint8_t * const *)av_info -> frame -> data,
-	          av_info -> frame -> linesize, 0, av_info -> frame -> height,
-	          (uint8_t * const *)bmp_info -> frame -> data, bmp_info -> frame -> linesize);
-
-	while(true)
-	{
-		int ret3 = avcodec_send_frame(bmp_info -> codec_ctx, bmp_info -> frame);
-		if(ret3 < 0 && ret3 != AVERROR(EAGAIN) && ret3 != AVERROR_EOF)
-		{
-			AVInfo_free(bmp_info);
-			sws_freeContext(sws_ctx);
-			AVInfo_reopen_input(av_info);
-			return false;
-		}
-
-		int ret4 = avcodec_receive_packet(bmp_info -> codec_ctx, bmp_info -> packet);
-		if(ret4 == AVERROR(EAGAIN))
-			continue;
-		else if(ret4 == AVERROR_EOF || ret4 == 0)
-			break;
-		else if(ret4 < 0)
-		{
-			AVInfo_free(bmp_info);
-			sws_freeContext(sws_ctx);
-			AVInfo_reopen_input(av_info);
-			return false;
-		}
-	}
-
-	sws_freeContext(sws_ctx);
-	bmp_info -> packet -> stream_index = 0;
-	bmp_info -> packet -> pts = AV_NOPTS_VALUE;
-	bmp_info -> packet -> dts = AV_NOPTS_VALUE;
-	bmp_info -> packet -> pos = -1;
 
-	if(av_write_frame(bmp_info -> fmt_ctx, bmp_info -> packet) < 0)
+	int flags = scaler_flags(vs_config.preview_quality, av_info -> frame -> width, av_info -> frame -> height,
+	                         width, height);
+	struct SwsContext *sws_ctx = acquire_scaler(av_info -> frame -> width, av_info -> frame -> height,
+	                                            av_info -> frame -> format,
+	                                            width, height, AV_PIX_FMT_BGRA, flags, 1);
+	if(sws_ctx)
 	{
-		AVInfo_free(bmp_info);
-		AVInfo_reopen_input(av_info);
-		return false;
+		sws_scale(sws_ctx, (const uint8_t * const *)av_info -> frame -> data,
+		          av_info -> frame -> linesize, 0, av_info -> frame -> height,
+		          preview -> data, preview -> linesize);
+		release_scaler(sws_ctx);
 	}
 
-	if(av_write_trailer(bmp_info -> fmt_ctx) < 0)
-	{
-		AVInfo_free(bmp_info);
-		AVInfo_reopen_input(av_info);
-		return false;
-	}
-
-	AVInfo_free(bmp_info);
+	release_source(av_info);
 	AVInfo_reopen_input(av_info);
-	return true;
+	return (sws_ctx != NULL);
 }
 
 bool AVInfo_create_wav(AVInfo *av_info)
@@ -205,237 +129,1093 @@ bool AVInfo_create_wav(AVInfo *av_info)
 	return true;
 }
 
-void put_frame_to_center(AVFrame *dest, AVFrame *src)
+void fill_letterbox(AVFrame *frame, int x_min, int y_min, int width, int height)
 {
-	int x_min = (dest -> width - src -> width) / 2;
-	int x_max = x_min + src -> width;
-	int y_min = (dest -> height - src -> height) / 2;
-	int y_max = y_min + src -> height;
-
-	for(int x = 0; x < dest -> width; ++x)
+	if(frame -> format == AV_PIX_FMT_YUV420P || frame -> format == AV_PIX_FMT_GRAY8)
 	{
-		for(int y = 0; y < dest -> height; ++y)
+		/**
+		 * White in limited range for YUV420P and in full range for GRAY8. The planes of the 
+		 * chroma are half the size of the luma.
+		 */
+		const int border_value[3] = {(frame -> format == AV_PIX_FMT_GRAY8 ? 255 : 235), 128, 128};
+		int nb_planes = (frame -> format == AV_PIX_FMT_GRAY8 ? 1 : 3);
+		for(int c = 0; c < nb_planes; ++c)
 		{
-			uint8_t *R = dest -> data[0] + y * dest -> linesize[0] + 4 * x;
-			uint8_t *G = dest -> data[0] + y * dest -> linesize[0] + 4 * x + 1;
-			uint8_t *B = dest -> data[0] + y * dest -> linesize[0] + 4 * x + 2;
-			uint8_t *A = dest -> data[0] + y * dest -> linesize[0] + 4 * x + 3;
-			if(x < x_min || x >= x_max || y < y_min || y >= y_max)
-			{
-				*R = 255;  *G = 255;
-				*B = 255;  *A = 0;
-			}
-			else
+			int shift = (c == 0 ? 0 : 1);
+			int plane_w = (frame -> width + shift) >> shift;
+			int plane_h = (frame -> height + shift) >> shift;
+			int x_begin = x_min >> shift, x_end = (x_min + width + shift) >> shift;
+			int y_begin = y_min >> shift, y_end = (y_min + height + shift) >> shift;
+			for(int y = 0; y < plane_h; ++y)
 			{
-				*R = *(src -> data[0] + (y - y_min) * src -> linesize[0] + 4 * (x - x_min));
-				*G = *(src -> data[0] + (y - y_min) * src -> linesize[0] + 4 * (x - x_min) + 1);
-				*B = *(src -> data[0] + (y - y_min) * src -> linesize[0] + 4 * (x - x_min) + 2);
-				*A = *(src -> data[0] + (y - y_min) * src -> linesize[0] + 4 * (x - x_min) + 3);
+				uint8_t *row = frame -> data[c] + y * frame -> linesize[c];
+				if(y < y_begin || y >= y_end)
+					memset(row, border_value[c], plane_w);
+				else
+				{
+					memset(row, border_value[c], x_begin);
+					memset(row + x_end, border_value[c], plane_w - x_end);
+				}
 			}
 		}
+		return;
+	}
+
+	/* The border is white and transparent, so background images show through. */
+	const uint8_t border_pixel[4] = {255, 255, 255, 0};
+	uint8_t *border_row = av_malloc(4 * frame -> width);
+	if(!border_row)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	for(int x = 0; x < frame -> width; ++x)
+		memcpy(border_row + 4 * x, border_pixel, 4);
+
+	int x_max = x_min + width;
+	int y_max = y_min + height;
+	for(int y = 0; y < frame -> height; ++y)
+	{
+		uint8_t *row = frame -> data[0] + y * frame -> linesize[0];
+		if(y < y_min || y >= y_max)
+			memcpy(row, border_row, 4 * frame -> width);
+		else
+		{
+			memcpy(row, border_row, 4 * x_min);
+			memcpy(row + 4 * x_max, border_row, 4 * (frame -> width - x_max));
+		}
 	}
+	av_free(border_row);
+}
+
+DecodeBudget decode_budget;
+
+void decode_budget_init()
+{
+	decode_budget.in_use = 0;
+	decode_budget.cached = 0;
+	InitializeCriticalSection(&decode_budget.lock);
+	InitializeConditionVariable(&decode_budget.released);
+}
+
+void decode_budget_free()
+{
+	DeleteCriticalSection(&decode_budget.lock);
+}
+
+int64_t decoded_size(AVInfo *image_info)
+{
+	int size = av_image_get_buffer_size(image_info -> codec_ctx -> pix_fmt, 
+	                                    image_info -> width, image_info -> height, 1);
+	/* the largest 8-bit pixel format if the decoder does not know it yet */
+	return (size > 0 ? size : (int64_t)4 * image_info -> width * image_info -> height);
+}
+
+void reserve_decode_memory(int64_t bytes)
+{
+	int64_t limit = (int64_t)vs_config.decode_memory << 20;
+	EnterCriticalSection(&decode_budget.lock);
+	while(limit > 0 && decode_budget.in_use > 0 && decode_budget.in_use + bytes > limit)
+	{
+		if(decode_budget.cached > 0)
+		{
+			/* Images kept by the source cache give way to images being decoded. */
+			LeaveCriticalSection(&decode_budget.lock);
+			source_cache_drop_oldest();
+			EnterCriticalSection(&decode_budget.lock);
+		}
+		else  SleepConditionVariableCS(&decode_budget.released, &decode_budget.lock, INFINITE);
+	}
+	decode_budget.in_use += bytes;
+	LeaveCriticalSection(&decode_budget.lock);
+}
+
+void release_decode_memory(int64_t bytes)
+{
+	EnterCriticalSection(&decode_budget.lock);
+	decode_budget.in_use -= bytes;
+	LeaveCriticalSection(&decode_budget.lock);
+	WakeAllConditionVariable(&decode_budget.released);
 }
 
-bool decode_image(AVInfo *image_info, AVFrame *frame, int width, int height)
+void cache_decode_memory(int64_t reserved, int64_t bytes)
 {
-	if(av_read_frame(image_info -> fmt_ctx, image_info -> packet) < 0)
+	EnterCriticalSection(&decode_budget.lock);
+	decode_budget.in_use += bytes - reserved;
+	decode_budget.cached += bytes;
+	LeaveCriticalSection(&decode_budget.lock);
+	/* waiting threads can now drop the image */
+	WakeAllConditionVariable(&decode_budget.released);
+}
+
+void uncache_decode_memory(int64_t bytes)
+{
+	EnterCriticalSection(&decode_budget.lock);
+	decode_budget.cached -= bytes;
+	LeaveCriticalSection(&decode_budget.lock);
+	release_decode_memory(bytes);
+}
+
+SourceCache source_cache;
+
+void source_cache_init()
+{
+	source_cache.nb_entries = 0;
+	source_cache.in_use = 0;
+	source_cache.clock = 0;
+	source_cache.hits = 0;
+	source_cache.misses = 0;
+	InitializeCriticalSection(&source_cache.lock);
+}
+
+void source_cache_free()
+{
+	for(int i = 0; i < source_cache.nb_entries; ++i)
+		av_frame_free(&source_cache.entries[i] -> decoded);
+	source_cache.nb_entries = 0;
+	source_cache.in_use = 0;
+	DeleteCriticalSection(&source_cache.lock);
+}
+
+bool decode_source(AVInfo *image_info)
+{
+	EnterCriticalSection(&source_cache.lock);
+	if(image_info -> decoded != NULL)
+	{
+		image_info -> decoded_used = ++source_cache.clock;
+		++source_cache.hits;
+		int ret = av_frame_ref(image_info -> frame, image_info -> decoded);
+		LeaveCriticalSection(&source_cache.lock);
+		if(ret < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		return true;
+	}
+	++source_cache.misses;
+	LeaveCriticalSection(&source_cache.lock);
+
+	/* Only decoding takes memory from the budget; a cached image is shared. */
+	image_info -> reserved = decoded_size(image_info);
+	reserve_decode_memory(image_info -> reserved);
+	image_info -> consumed = true;
+	if(av_read_frame(image_info -> fmt_ctx, image_info -> packet) < 0 ||
+	   avcodec_send_packet(image_info -> codec_ctx, image_info -> packet) < 0 ||
+	   avcodec_receive_frame(image_info -> codec_ctx, image_info -> frame) < 0)
+	{
+		release_source(image_info);
 		return false;
-/*
-	while(true)
+	}
+
+	AVFrame *frame = image_info -> frame;
+	int64_t bytes = av_image_get_buffer_size(frame -> format, frame -> width, frame -> height, 1);
+	int64_t limit = (int64_t)vs_config.source_cache << 20;
+	if(bytes <= 0 || bytes > limit)
+		return true;
+
+	EnterCriticalSection(&source_cache.lock);
+	source_cache_shrink(bytes);
+	image_info -> decoded = av_frame_clone(frame);
+	if(image_info -> decoded != NULL)
 	{
-		int ret1 = avcodec_send_packet(image_info -> codec_ctx, image_info -> packet);
-		if(ret1 < 0 && ret1 != AVERROR(EAGAIN) && ret1 != AVERROR_EOF)
-			return false;
+		image_info -> decoded_used = ++source_cache.clock;
+		source_cache.entries[source_cache.nb_entries++] = image_info;
+		source_cache.in_use += bytes;
+		/* the memory is the cache's from now on, since the frame shares its buffers */
+		cache_decode_memory(image_info -> reserved, bytes);
+		image_info -> reserved = 0;
+	}
+	LeaveCriticalSection(&source_cache.lock);
+	return true;
+}
 
-		int ret2 = avcodec_receive_frame(image_info -> codec_ctx, image_info -> frame);
-		if(ret2 == AVERROR(EAGAIN))
-			continue;
-		else if(ret2 == AVERROR_EOF || ret2 == 0)
-			break;
-		else if(ret2 < 0)
-			return false;
+void release_source(AVInfo *image_info)
+{
+	av_frame_unref(image_info -> frame);
+	av_packet_unref(image_info -> packet);
+	if(image_info -> reserved > 0)
+		release_decode_memory(image_info -> reserved);
+	image_info -> reserved = 0;
+}
+
+void source_cache_shrink(int64_t bytes)
+{
+	int64_t limit = (int64_t)vs_config.source_cache << 20;
+	EnterCriticalSection(&source_cache.lock);
+	while(source_cache.nb_entries > 0 && 
+	      (source_cache.in_use + bytes > limit || source_cache.nb_entries + (bytes > 0) > SOURCE_CACHE_LIMIT))
+		source_cache_drop_oldest();
+	LeaveCriticalSection(&source_cache.lock);
+}
+
+void source_cache_drop_oldest()
+{
+	EnterCriticalSection(&source_cache.lock);
+	if(source_cache.nb_entries > 0)
+	{
+		int oldest = 0;
+		for(int i = 1; i < source_cache.nb_entries; ++i)
+			if(source_cache.entries[i] -> decoded_used < source_cache.entries[oldest] -> decoded_used)
+				oldest = i;
+		source_cache_drop(oldest);
 	}
-*/
+	LeaveCriticalSection(&source_cache.lock);
+}
 
-	if(avcodec_send_packet(image_info -> codec_ctx, image_info -> packet) < 0)
-		return false;
-	if(avcodec_receive_frame(image_info -> codec_ctx, image_info -> frame) < 0)
+void source_cache_drop(int index)
+{
+	AVInfo *image_info = source_cache.entries[index];
+	AVFrame *decoded = image_info -> decoded;
+	int64_t bytes = av_image_get_buffer_size(decoded -> format, decoded -> width, decoded -> height, 1);
+	source_cache.in_use -= bytes;
+	av_frame_free(&image_info -> decoded);
+	source_cache.entries[index] = source_cache.entries[--source_cache.nb_entries];
+	uncache_decode_memory(bytes);
+}
+
+void source_cache_remove(AVInfo *image_info)
+{
+	if(image_info -> decoded == NULL)
+		return;
+
+	EnterCriticalSection(&source_cache.lock);
+	for(int i = 0; i < source_cache.nb_entries; ++i)
+		if(source_cache.entries[i] == image_info)
+		{
+			source_cache_drop(i);
+			break;
+		}
+	LeaveCriticalSection(&source_cache.lock);
+}
+
+bool detect_gray(AVInfo *image_info)
+{
+	image_info -> gray = false;
+	if(!decode_source(image_info))
+	{
+		AVInfo_reopen_input(image_info);
 		return false;
+	}
 
-	double scaling_w = (double)width  / image_info -> frame -> width;
-	double scaling_h = (double)height / image_info -> frame -> height;
+	AVFrame *frame = image_info -> frame;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame -> format);
+	bool gray = true;
+	if(desc -> flags & AV_PIX_FMT_FLAG_PAL)
+	{
+		/* The palette is in 32-bit native-endian ARGB. */
+		const uint32_t *palette = (const uint32_t *)frame -> data[1];
+		for(int i = 0; i < 256 && gray; ++i)
+		{
+			int r = (palette[i] >> 16) & 0xFF, g = (palette[i] >> 8) & 0xFF, b = palette[i] & 0xFF;
+			gray = (abs(r - g) <= GRAY_TOLERANCE && abs(g - b) <= GRAY_TOLERANCE);
+		}
+	}
+	else if(desc -> nb_components <= 2)
+		gray = true;  /* gray with or without alpha */
+	else if(desc -> comp[0].depth != 8 || desc -> comp[1].depth != 8 || desc -> comp[2].depth != 8 ||
+	        (desc -> flags & AV_PIX_FMT_FLAG_BITSTREAM))
+		gray = false;
+	else if(desc -> flags & AV_PIX_FMT_FLAG_RGB)
+	{
+		/* packed or planar RGB: the three channels are compared at every pixel */
+		for(int y = 0; y < frame -> height && gray; ++y)
+			for(int x = 0; x < frame -> width && gray; ++x)
+			{
+				int value[3];
+				for(int c = 0; c < 3; ++c)
+					value[c] = frame -> data[desc -> comp[c].plane][y * frame -> linesize[desc -> comp[c].plane] +
+					           x * desc -> comp[c].step + desc -> comp[c].offset];
+				gray = (abs(value[0] - value[1]) <= GRAY_TOLERANCE && abs(value[1] - value[2]) <= GRAY_TOLERANCE);
+			}
+	}
+	else
+	{
+		/* YUV: every chroma sample is neutral */
+		int chroma_w = AV_CEIL_RSHIFT(frame -> width, desc -> log2_chroma_w);
+		int chroma_h = AV_CEIL_RSHIFT(frame -> height, desc -> log2_chroma_h);
+		for(int c = 1; c <= 2 && gray; ++c)
+			for(int y = 0; y < chroma_h && gray; ++y)
+				for(int x = 0; x < chroma_w && gray; ++x)
+					gray = (abs(frame -> data[desc -> comp[c].plane][y * frame -> linesize[desc -> comp[c].plane] +
+					        x * desc -> comp[c].step + desc -> comp[c].offset] - 128) <= GRAY_TOLERANCE);
+	}
+
+	image_info -> gray = gray;
+	release_source(image_info);
+	AVInfo_reopen_input(image_info);
+	return true;
+}
+
+int scaler_flags(VSQuality quality, int src_w, int src_h, int dst_w, int dst_h)
+{
+	if(quality == VSQUALITY_DRAFT)
+		return SWS_FAST_BILINEAR;
+	if(src_w == dst_w && src_h == dst_h)
+		return SWS_BILINEAR;
+	if(quality == VSQUALITY_HIGH)
+		return SWS_LANCZOS;
+	return (dst_w <= src_w && dst_h <= src_h) ? SWS_AREA : SWS_BICUBIC;
+}
+
+const wchar_t *quality_name(VSQuality quality)
+{
+	switch(quality)
+	{
+		case VSQUALITY_DRAFT:     return L"draft";
+		case VSQUALITY_STANDARD:  return L"standard";
+		default:                  return L"high";
+	}
+}
+
+bool decode_image(AVInfo *image_info, AVFrame *frame, int width, int height,
+                  enum AVPixelFormat format, VSQuality quality)
+{
+	bool ret = decode_and_scale(image_info, frame, width, height, format, quality);
+
+	/* The decoded image is either kept by the source cache or not needed any more. */
+	release_source(image_info);
+	return ret;
+}
+
+bool fit_image(int src_w, int src_h, int width, int height, int *scaled_w, int *scaled_h)
+{
+	double scaling_w = (double)width  / src_w;
+	double scaling_h = (double)height / src_h;
 	double scaling = ((scaling_w < scaling_h) ? scaling_w : scaling_h);
-	int scaled_w = image_info -> frame -> width * scaling;
-	int scaled_h = image_info -> frame -> height * scaling;
-	scaled_w = scaled_w / 4 * 4;
-	scaled_h = scaled_h / 4 * 4;
+	*scaled_w = (int)(src_w * scaling) / 4 * 4;
+	*scaled_h = (int)(src_h * scaling) / 4 * 4;
+
+	/**
+	 * A page which already fills the frame up to the rounding of its size is not resampled,
+	 * only padded. This is the usual case for scores engraved at a fixed resolution.
+	 */
+	bool pass_through = (src_w <= width && src_h <= height && (width - src_w < 4 || height - src_h < 4));
+	if(pass_through)
+	{
+		*scaled_w = src_w;
+		*scaled_h = src_h;
+	}
+	return pass_through;
+}
+
+bool decode_and_scale(AVInfo *image_info, AVFrame *frame, int width, int height,
+                      enum AVPixelFormat format, VSQuality quality)
+{
+	if(!decode_source(image_info))
+		return false;
 
-	AVFrame *temp_frame = av_frame_alloc();
-	temp_frame -> format = AV_PIX_FMT_RGBA;
-	temp_frame -> width  = scaled_w;
-	temp_frame -> height = scaled_h;
-	if(av_frame_get_buffer(temp_frame, 0) < 0)
+	int src_w = image_info -> frame -> width;
+	int src_h = image_info -> frame -> height;
+	int scaled_w, scaled_h;
+	bool pass_through = fit_image(src_w, src_h, width, height, &scaled_w, &scaled_h);
+
+	/* every page of an export has the same size, so the buffers are taken from a pool */
+	if(!get_pooled_buffer(frame, format, width, height))
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
 
-	struct SwsContext *sws_ctx = sws_alloc_context();
-	if(!sws_ctx)
+	/**
+	 * The image is scaled straight into the center of the frame. The left edge is kept on 
+	 * a multiple of 4 pixels so that the rows stay aligned for swscale. In YUV420P the top
+	 * edge is even so that the chroma planes start on a whole sample too.
+	 */
+	int x_min = (width - scaled_w) / 2 / 4 * 4;
+	int y_min = (height - scaled_h) / 2;
+	uint8_t *dest[4] = {frame -> data[0] + y_min * frame -> linesize[0] + 4 * x_min, NULL, NULL, NULL};
+	if(format == AV_PIX_FMT_GRAY8)
+		dest[0] = frame -> data[0] + y_min * frame -> linesize[0] + x_min;
+	else if(format == AV_PIX_FMT_YUV420P)
 	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
+		y_min = y_min / 2 * 2;
+		dest[0] = frame -> data[0] + y_min * frame -> linesize[0] + x_min;
+		dest[1] = frame -> data[1] + y_min / 2 * frame -> linesize[1] + x_min / 2;
+		dest[2] = frame -> data[2] + y_min / 2 * frame -> linesize[2] + x_min / 2;
 	}
-	
-	sws_ctx = sws_getCachedContext(sws_ctx, image_info -> frame -> width, image_info -> frame -> height,
-	                               (enum AVPixelFormat)image_info -> frame -> format,
-	                               scaled_w, scaled_h, AV_PIX_FMT_RGBA, SWS_LANCZOS, 0, 0, 0);
+	fill_letterbox(frame, x_min, y_min, scaled_w, scaled_h);
+
+	if(pass_through && image_info -> frame -> format == format)
+	{
+		/* same size and pixel format: the rows are copied */
+		av_image_copy(dest, frame -> linesize, (const uint8_t **)image_info -> frame -> data,
+		              image_info -> frame -> linesize, format, src_w, src_h);
+		return true;
+	}
+
+	/* At the same size swscale only converts the pixel format. */
+	struct SwsContext *sws_ctx = acquire_scaler(src_w, src_h, image_info -> frame -> format,
+	                                            scaled_w, scaled_h, format,
+	                                            scaler_flags(quality, src_w, src_h, scaled_w, scaled_h),
+	                                            vs_config.scaler_threads);
 	if(!sws_ctx)
 	{
-		av_frame_free(&temp_frame);
-		sws_freeContext(sws_ctx);
+		av_frame_unref(frame);
 		return false;
 	}
+	bool ret = scale_into_frame(sws_ctx, image_info -> frame, frame, dest);
+	release_scaler(sws_ctx);
+	if(!ret)
+		av_frame_unref(frame);
+	return ret;
+}
 
-	sws_scale(sws_ctx, (const uint8_t * const *)image_info -> frame -> data,
-	          image_info -> frame -> linesize, 0, image_info -> frame -> height,
-	          (uint8_t * const *)temp_frame -> data, temp_frame -> linesize);
-	sws_freeContext(sws_ctx);
-
-	frame -> format = AV_PIX_FMT_RGBA;
-	frame -> width  = width;
-	frame -> height = height;
-	if(av_frame_get_buffer(frame, 0) < 0)
+bool render_background(AVInfo *bg_info, int width, int height,
+                       enum AVPixelFormat format, VSQuality quality, AVFrame *bg_frame)
+{
+	EnterCriticalSection(&bg_info -> lock);
+	AVFrame **rendered = (format == AV_PIX_FMT_GRAY8 ? &bg_info -> rendered_gray : &bg_info -> rendered);
+	bool ret = true;
+	if(*rendered == NULL)
+	{
+		*rendered = av_frame_alloc();
+		if(!*rendered)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		ret = decode_image(bg_info, *rendered, width, height, format, quality);
+		AVInfo_reopen_input(bg_info);
+		if(!ret)
+			av_frame_free(rendered);
+	}
+	/* The frame stays valid for the caller even if it is released by another thread. */
+	if(ret && av_frame_ref(bg_frame, *rendered) < 0)
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
+	LeaveCriticalSection(&bg_info -> lock);
+	return ret;
+}
 
-	put_frame_to_center(frame, temp_frame);
-	av_frame_free(&temp_frame);
-	return true;
+void release_background(AVInfo *bg_info)
+{
+	EnterCriticalSection(&bg_info -> lock);
+	if(bg_info -> bg_uses > 0 && --(bg_info -> bg_uses) == 0)
+	{
+		av_frame_free(&bg_info -> rendered);
+		av_frame_free(&bg_info -> rendered_gray);
+	}
+	LeaveCriticalSection(&bg_info -> lock);
 }
 
-bool mix_images(AVInfo *image_info, AVInfo **bg_info, AVFrame *frame1,
-                AVFrame *frame2, int pos, int bg_count)
+bool mix_images(AVInfo **bg_info, int *bg_list, int nb_bg, AVFrame *frame1, AVFrame *frame2,
+                VSQuality quality)
 {
-	for(int j = 0; j < bg_count; ++j)
+	AVFrame *bg_frame = av_frame_alloc();
+	if(!bg_frame)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	for(int k = 0; k < nb_bg; ++k)
 	{
-		if(bg_info[j] -> begin - 1 <= pos && bg_info[j] -> end - 1 >= pos)
+		AVInfo *bg = bg_info[ bg_list[k] ];
+		if(!render_background(bg, frame1 -> width, frame1 -> height, frame1 -> format, quality, bg_frame))
 		{
-			AVFrame *bg_frame = av_frame_alloc();
-			if(!decode_image(bg_info[j], bg_frame, frame1 -> width, frame1 -> height))
-			{
-				AVInfo_reopen_input(bg_info[j]);
-				av_frame_free(&bg_frame);
-				return false;
-			}
+			av_frame_free(&bg_frame);
+			return false;
+		}
 
+		if(frame1 -> format == AV_PIX_FMT_YUV420P)
+			blend_planes(frame1, bg_frame, bg -> blend);
+		else
+		{
+			BlendFunction blend = (frame1 -> format == AV_PIX_FMT_GRAY8 ? get_gray_blend_function(bg -> blend)
+			                                                            : get_blend_function(bg -> blend));
 			for(int y = 0; y < frame1 -> height; ++y)
-			{
-				for(int x = 0; x < frame1 -> linesize[0]; ++x)
-				{
-					/* skip alpha channels */
-					if(x % 4 == 3)  continue;
-					
-					uint8_t *data1 = frame1 -> data[0] + y * frame1 -> linesize[0] + x;
-					uint8_t *data2 = bg_frame -> data[0] + y * bg_frame -> linesize[0] + x;
-					if(*data1 > *data2)
-						*data1 = *data2;
-				}
-			}
-			
-			AVInfo_reopen_input(bg_info[j]);
-			av_frame_free(&bg_frame);
+				blend(frame1 -> data[0] + y * frame1 -> linesize[0],
+				      bg_frame -> data[0] + y * bg_frame -> linesize[0], frame1 -> width);
+		}
+		av_frame_unref(bg_frame);
+		release_background(bg);
+	}
+	av_frame_free(&bg_frame);
+
+	if(frame1 -> format == AV_PIX_FMT_GRAY8)
+	{
+		if(!get_pooled_buffer(frame2, AV_PIX_FMT_YUV420P, frame1 -> width, frame1 -> height))
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		gray_to_yuv(frame1, frame2);
+		return true;
+	}
+
+	if(frame1 -> format == AV_PIX_FMT_YUV420P)
+	{
+		/* already in the pixel format of the encoder */
+		if(av_frame_ref(frame2, frame1) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
 		}
+		return true;
 	}
 
-	struct SwsContext *sws_ctx = sws_alloc_context();
+	struct SwsContext *sws_ctx = acquire_scaler(frame1 -> width, frame1 -> height, AV_PIX_FMT_RGBA,
+	                                            frame1 -> width, frame1 -> height, AV_PIX_FMT_YUV420P,
+	                                            scaler_flags(quality, frame1 -> width, frame1 -> height,
+	                                                         frame1 -> width, frame1 -> height),
+	                                            vs_config.scaler_threads);
 	if(!sws_ctx)
+		return false;
+
+	if(!get_pooled_buffer(frame2, AV_PIX_FMT_YUV420P, frame1 -> width, frame1 -> height))
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
 
-	sws_ctx = sws_getCachedContext(sws_ctx, frame1 -> width, frame1 -> height, AV_PIX_FMT_RGBA,
-	                               frame1 -> width, frame1 -> height, AV_PIX_FMT_YUV420P, 
-	                               SWS_LANCZOS, 0, 0, 0);
-	if(!sws_ctx)
+	bool ret = scale_into_frame(sws_ctx, frame1, frame2, frame2 -> data);
+	release_scaler(sws_ctx);
+	if(!ret)
+		av_frame_unref(frame2);
+	return ret;
+}
+
+void gray_to_yuv(AVFrame *gray, AVFrame *yuv)
+{
+	/* the conversion of swscale from full range to limited range */
+	uint8_t luma[256];
+	for(int i = 0; i < 256; ++i)
+		luma[i] = 16 + (i * 219 + 127) / 255;
+
+	for(int y = 0; y < gray -> height; ++y)
 	{
-		sws_freeContext(sws_ctx);
-		return false;
+		const uint8_t *src = gray -> data[0] + y * gray -> linesize[0];
+		uint8_t *dest = yuv -> data[0] + y * yuv -> linesize[0];
+		for(int x = 0; x < gray -> width; ++x)
+			dest[x] = luma[src[x]];
 	}
+	for(int c = 1; c <= 2; ++c)
+		for(int y = 0; y < (yuv -> height + 1) / 2; ++y)
+			memset(yuv -> data[c] + y * yuv -> linesize[c], 128, (yuv -> width + 1) / 2);
+}
 
-	frame2 -> format = AV_PIX_FMT_YUV420P;
-	frame2 -> width  = frame1 -> width;
-	frame2 -> height = frame1 -> height;
-	if(av_frame_get_buffer(frame2, 0) < 0)
+bool encode_image(AVInfo *video_info, int64_t begin_pts, int64_t nb_ticks, EncodedImage *cache_entry)
+{
+	/**
+	 * The image is still. If the packets of the codec can be copied, it is only encoded twice: 
+	 * once as a key frame, and once as a P-frame which changes nothing (see "encode_still_image").
+	 * The other frames are copies of these two packets, written by "write_pending_images" as 
+	 * soon as the encoder gives them out. For variable frame rate only the key frame is needed.
+	 * Otherwise every frame is encoded; the first one is always a key frame.
+	 */
+	if(nb_ticks <= 0)
+		return true;
+
+	PendingImage image = {
+		.begin_pts = begin_pts,
+		.nb_ticks = nb_ticks,
+		.nb_packets = image_packet_count(video_info, nb_ticks),
+		.cache_entry = cache_entry
+	};
+	image.packets = packet_array_alloc(image.nb_packets);
+	if(av_fifo_write(video_info -> pending, &image, 1) < 0)
 	{
 		VS_print_log(INSUFFICIENT_MEMORY);
 		system("pause >nul 2>&1");
 		abort();
 	}
 
-	sws_scale(sws_ctx, (const uint8_t * const *)frame1 -> data,
-	          frame1 -> linesize, 0, frame1 -> height,
-	          (uint8_t * const *)frame2 -> data, frame2 -> linesize);
+	bool ret = true;
+	int64_t step = image_frame_step(video_info);
+	/* The quantizer of a fixed quality encoder is taken from the frame. */
+	video_info -> frame2 -> quality = video_info -> codec_ctx2 -> global_quality;
+	if(video_info -> copy_frames && image.nb_packets == 2 && nb_ticks > 2)
+		return encode_still_image(video_info, &image);
+	for(int i = 0; i < image.nb_packets && ret; ++i)
+	{
+		if(i == 0)
+			video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_I;
+		else if(video_info -> copy_frames)
+			video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_P;
+		else  video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_NONE;
+		video_info -> frame2 -> pts = begin_pts + i * step;
+		ret = send_image_frame(video_info);
+	}
+	video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_NONE;
+	return ret;
+}
+
+bool encode_still_image(AVInfo *video_info, PendingImage *image)
+{
+	/* The packets are not written before the P-frame is checked. */
+	video_info -> hold_pending = true;
+	video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_I;
+	video_info -> frame2 -> pts = image -> begin_pts;
+	bool ret = send_image_frame(video_info);
+	video_info -> frame2 -> pict_type = AV_PICTURE_TYPE_NONE;
+	if(!ret)
+	{
+		video_info -> hold_pending = false;
+		return false;
+	}
+
+	/**
+	 * The P-frame is the key frame as the decoder shows it, so its motion vectors are zero and
+	 * it has no residual. It still has to show exactly the same picture, or the copies drift.
+	 */
+	bool still = (image -> packets[0] -> data != NULL && 
+	              decode_video_packet(video_info, image -> packets[0], video_info -> frame3));
+	if(still)
+	{
+		AVFrame *frame3 = video_info -> frame3;
+		frame3 -> pict_type = AV_PICTURE_TYPE_P;
+		frame3 -> pts = image -> begin_pts + 1;
+		frame3 -> quality = video_info -> codec_ctx2 -> global_quality;
+		ret = send_video_frame(video_info, frame3);
+		AVFrame *decoded = av_frame_alloc();
+		if(!decoded)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		still = (ret && image -> packets[1] -> data != NULL && 
+		         decode_video_packet(video_info, image -> packets[1], decoded) &&
+		         same_yuv_frames(decoded, frame3));
+		av_frame_free(&decoded);
+	}
+	else
+	{
+		video_info -> frame2 -> pts = image -> begin_pts + 1;
+		ret = send_image_frame(video_info);
+	}
+	av_frame_unref(video_info -> frame3);
+	video_info -> hold_pending = false;
+	if(!ret)
+		return false;
+	if(still)
+		return write_pending_images(video_info);
+
+	/* The P-frame is written once, and the other frames are encoded one by one. */
+	int nb_frames = image -> nb_ticks;
+	AVPacket **packets = packet_array_alloc(nb_frames);
+	av_packet_move_ref(packets[0], image -> packets[0]);
+	av_packet_move_ref(packets[1], image -> packets[1]);
+	packet_array_free(&image -> packets, image -> nb_packets);
+	image -> packets = packets;
+	image -> nb_packets = nb_frames;
+	replace_last_pending(video_info, image);
+	for(int i = 2; i < nb_frames && ret; ++i)
+	{
+		video_info -> frame2 -> pts = image -> begin_pts + i;
+		ret = send_image_frame(video_info);
+	}
+	return ret && write_pending_images(video_info);
+}
 
-	sws_freeContext(sws_ctx);
+bool decode_video_packet(AVInfo *video_info, AVPacket *packet, AVFrame *frame)
+{
+	if(video_info -> codec_ctx3 == NULL)
+		return false;
+	return (avcodec_send_packet(video_info -> codec_ctx3, packet) >= 0 &&
+	        avcodec_receive_frame(video_info -> codec_ctx3, frame) >= 0);
+}
+
+bool same_yuv_frames(AVFrame *frame1, AVFrame *frame2)
+{
+	if(frame1 -> format != AV_PIX_FMT_YUV420P || frame2 -> format != AV_PIX_FMT_YUV420P ||
+	   frame1 -> width != frame2 -> width || frame1 -> height != frame2 -> height)
+		return false;
+	for(int c = 0; c < 3; ++c)
+	{
+		int width = (c == 0 ? frame1 -> width : (frame1 -> width + 1) / 2);
+		int height = (c == 0 ? frame1 -> height : (frame1 -> height + 1) / 2);
+		for(int y = 0; y < height; ++y)
+			if(memcmp(frame1 -> data[c] + y * frame1 -> linesize[c], 
+			          frame2 -> data[c] + y * frame2 -> linesize[c], width) != 0)
+				return false;
+	}
 	return true;
 }
 
-bool encode_image(AVInfo *video_info, int64_t begin_pts, int nb_frames)
+void replace_last_pending(AVInfo *video_info, PendingImage *image)
 {
-	for(int frame = 0; frame < nb_frames; ++frame)
+	/* The FIFO can only be written at its end, so it is read out and written again. */
+	size_t nb_pending = av_fifo_can_read(video_info -> pending);
+	PendingImage *images = malloc(sizeof(PendingImage) * nb_pending);
+	if(images == NULL)
 	{
-		while(true)
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	av_fifo_read(video_info -> pending, images, nb_pending);
+	images[nb_pending - 1] = *image;
+	av_fifo_write(video_info -> pending, images, nb_pending);
+	free(images);
+}
+
+bool reuse_image(AVInfo *video_info, EncodedImage *encoded, int64_t begin_pts, 
+                 int64_t nb_ticks, EncodedImage *cache_entry)
+{
+	if(nb_ticks <= 0)
+		return true;
+
+	PendingImage image = {
+		.begin_pts = begin_pts,
+		.nb_ticks = nb_ticks,
+		.nb_packets = image_packet_count(video_info, nb_ticks),
+		.cache_entry = cache_entry
+	};
+	image.packets = packet_array_alloc(image.nb_packets);
+	for(int i = 0; i < image.nb_packets; ++i)
+	{
+		if(av_packet_ref(image.packets[i], encoded -> packets[i]) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
+	if(av_fifo_write(video_info -> pending, &image, 1) < 0)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	/* Images sent to the encoder before may still be waiting for their packets. */
+	return write_pending_images(video_info);
+}
+
+bool can_reuse_image(AVInfo *video_info, EncodedImage *encoded, int64_t nb_ticks)
+{
+	/**
+	 * Copied packets can serve any duration; otherwise there is a packet for every frame. 
+	 * A still image whose P-frame failed the check has a packet for every frame too.
+	 */
+	int nb_packets = image_packet_count(video_info, nb_ticks);
+	if(video_info -> copy_frames && encoded -> nb_packets <= 2)
+		return (encoded -> nb_packets >= nb_packets);
+	return (encoded -> nb_packets == nb_packets && !video_info -> copy_frames);
+}
+
+bool can_join_images(AVInfo *video_info, int64_t prev_ticks)
+{
+	if(video_info -> copy_frames || prev_ticks <= 0)
+		return true;
+	return (image_packet_count(video_info, prev_ticks) > 1);
+}
+
+int64_t image_frame_step(AVInfo *video_info)
+{
+	if(video_info -> vfr)
+		return VFR_keyframe_interval * VFR_timebase;
+	return 1;
+}
+
+int image_packet_count(AVInfo *video_info, int64_t nb_ticks)
+{
+	if(video_info -> copy_frames)
+		return (!video_info -> vfr && nb_ticks > 1 && video_info -> codec_ctx2 -> gop_size > 1) ? 2 : 1;
+	int64_t step = image_frame_step(video_info);
+	return (nb_ticks + step - 1) / step;
+}
+
+AVPacket **packet_array_alloc(int nb_packets)
+{
+	AVPacket **packets = malloc(sizeof(AVPacket *) * nb_packets);
+	if(packets == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	for(int i = 0; i < nb_packets; ++i)
+	{
+		packets[i] = av_packet_alloc();
+		if(!packets[i])
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
+	return packets;
+}
+
+void packet_array_free(AVPacket ***packets, int nb_packets)
+{
+	if(*packets == NULL)
+		return;
+	for(int i = 0; i < nb_packets; ++i)
+		av_packet_free(&(*packets)[i]);
+	free(*packets);
+	*packets = NULL;
+}
+
+void keep_image_packets(PendingImage *image)
+{
+	EncodedImage *entry = image -> cache_entry;
+	if(entry == NULL || entry -> nb_packets >= image -> nb_packets)
+		return;
+
+	packet_array_free(&entry -> packets, entry -> nb_packets);
+	entry -> nb_packets = image -> nb_packets;
+	entry -> packets = packet_array_alloc(image -> nb_packets);
+	for(int i = 0; i < image -> nb_packets; ++i)
+	{
+		if(av_packet_ref(entry -> packets[i], image -> packets[i]) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
+}
+
+bool send_image_frame(AVInfo *video_info)
+{
+	return send_video_frame(video_info, video_info -> frame2);
+}
+
+bool send_video_frame(AVInfo *video_info, AVFrame *frame)
+{
+	while(true)
+	{
+		int ret = avcodec_send_frame(video_info -> codec_ctx2, frame);
+		if(ret == 0)
+			break;
+		else if(ret == AVERROR(EAGAIN))
 		{
-			int ret3 = avcodec_send_frame(video_info -> codec_ctx2, video_info -> frame);
-			int ret4 = 0;
-			if(ret3 < 0 && ret3 != AVERROR(EAGAIN) && ret3 != AVERROR_EOF)
+			/* The encoder is full; take packets out before sending the frame again. */
+			if(!receive_image_packets(video_info))
 				return false;
-			else if(ret3 == AVERROR_EOF)
-			{
-				do {
-					ret4 = avcodec_receive_packet(video_info -> codec_ctx2, NULL);
-				} while(ret4 != AVERROR_EOF);
+		}
+		else  return false;
+	}
+	return receive_image_packets(video_info);
+}
+
+bool receive_image_packets(AVInfo *video_info)
+{
+	while(true)
+	{
+		int ret = avcodec_receive_packet(video_info -> codec_ctx2, video_info -> packet2);
+		if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			break;
+		else if(ret < 0)
+			return false;
+
+		/* Packets come out in the order of frames since there are no B-frames. */
+		PendingImage image;
+		size_t nb_pending = av_fifo_can_read(video_info -> pending);
+		size_t i;
+		for(i = 0; i < nb_pending; ++i)
+		{
+			av_fifo_peek(video_info -> pending, &image, 1, i);
+			if(!image_received(&image))
 				break;
-			}
-			else
-			{
-				ret4 = avcodec_receive_packet(video_info -> codec_ctx2, video_info -> packet);
-				if(ret4 == 0 || ret4 == AVERROR_EOF)
-					break;
-				else if(ret4 == AVERROR(EAGAIN))
-					continue;
-				else  return false;
-			}
 		}
+		if(i == nb_pending)
+		{
+			av_packet_unref(video_info -> packet2);
+			return false;
+		}
+
+		int j = 0;
+		while(image.packets[j] -> data)
+			++j;
+		av_packet_move_ref(image.packets[j], video_info -> packet2);
+	}
+	return write_pending_images(video_info);
+}
+
+bool write_pending_images(AVInfo *video_info)
+{
+	if(video_info -> fmt_ctx == NULL || video_info -> hold_pending)
+		return true;
 
-		AVPacket *packet_copy = av_packet_alloc();
-		if(av_packet_ref(packet_copy, video_info -> packet) < 0)
+	PendingImage image;
+	while(av_fifo_peek(video_info -> pending, &image, 1, 0) >= 0)
+	{
+		if(!image_received(&image))
+			break;
+
+		av_fifo_drain2(video_info -> pending, 1);
+		keep_image_packets(&image);
+		bool ret = write_image_packets(video_info, &image);
+		packet_array_free(&image.packets, image.nb_packets);
+		if(!ret)
 			return false;
+	}
+	return true;
+}
 
-		packet_copy -> stream_index = 1;
-		packet_copy -> duration = av_rescale_q(1, video_info -> codec_ctx2 -> time_base, 
-												  video_info -> fmt_ctx -> streams[1] -> time_base);
-		packet_copy -> pos = -1;
-		packet_copy -> pts = begin_pts + av_rescale_q(frame, video_info -> codec_ctx2 -> time_base, 
-													         video_info -> fmt_ctx -> streams[1] -> time_base);
-		packet_copy -> dts = packet_copy -> pts;
+bool image_received(PendingImage *image)
+{
+	return (image -> packets[image -> nb_packets - 1] -> data != NULL);
+}
 
-		if(av_write_frame(video_info -> fmt_ctx, packet_copy) < 0)
+bool write_image_packets(AVInfo *video_info, PendingImage *image)
+{
+	/**
+	 * A copy of the key frame is written at the beginning of every GOP so that the video is 
+	 * still seekable. For variable frame rate a copy of the key frame is written every 
+	 * "VFR_keyframe_interval" seconds. If packets are not copied, they are written in turn.
+	 */
+	int64_t step = image_frame_step(video_info);
+	int key_interval = (video_info -> vfr ? 1 : video_info -> codec_ctx2 -> gop_size);
+	int64_t nb_frames = (image -> nb_ticks + step - 1) / step;
+	bool copied = (image -> nb_packets < nb_frames);
+
+	/**
+	 * The time base of the stream is usually a fraction of that of the codec, so a frame 
+	 * lasts a whole number of stream ticks and the timestamps are only added up. 
+	 * Otherwise every timestamp is rescaled on its own so that rounding errors do not add up.
+	 */
+	AVRational codec_tb = video_info -> codec_ctx2 -> time_base;
+	AVRational stream_tb = video_info -> fmt_ctx -> streams[1] -> time_base;
+	AVRational ratio = av_div_q(codec_tb, stream_tb);
+	int64_t scale = (ratio.den == 1 ? ratio.num : 0);
+	int64_t pts = av_rescale_q(image -> begin_pts, codec_tb, stream_tb);
+
+	AVPacket *packet = video_info -> packet3;
+	for(int64_t tick = 0, frame = 0; tick < image -> nb_ticks; tick += step, ++frame)
+	{
+		int index = frame;
+		if(copied)
+			index = (frame % key_interval == 0 || image -> nb_packets == 1) ? 0 : 1;
+
+		/**
+		 * The muxer takes the packet. A packet written only once, or for the last time, is 
+		 * moved; otherwise a new reference is written. The packets are kept by 
+		 * "keep_image_packets" before they are written.
+		 */
+		if(!copied || frame == nb_frames - 1)
+			av_packet_move_ref(packet, image -> packets[index]);
+		else if(av_packet_ref(packet, image -> packets[index]) < 0)
+			return false;
+
+		int64_t ticks = FFMIN(step, image -> nb_ticks - tick);
+		if(scale == 0)
+			pts = av_rescale_q(image -> begin_pts + tick, codec_tb, stream_tb);
+		packet -> stream_index = 1;
+		packet -> duration = (scale != 0 ? ticks * scale : av_rescale_q(ticks, codec_tb, stream_tb));
+		packet -> pos = -1;
+		packet -> pts = pts;
+		packet -> dts = pts;
+		pts += step * scale;
+
+		if(image -> cache_entry != NULL)
+			image -> cache_entry -> bytes_written += packet -> size;
+		if(!write_packet(video_info, packet))
+		{
+			av_packet_unref(packet);
 			return false;
-		av_packet_unref(packet_copy);
-		av_packet_free(&packet_copy);
+		}
 	}
+	if(image -> cache_entry != NULL)
+		image -> cache_entry -> ticks_written += image -> nb_ticks;
 	return true;
 }
 
+bool flush_image_encoder(AVInfo *video_info)
+{
+	if(avcodec_send_frame(video_info -> codec_ctx2, NULL) < 0)
+		return false;
+	if(!receive_image_packets(video_info))
+		return false;
+	return (video_info -> fmt_ctx == NULL || av_fifo_can_read(video_info -> pending) == 0);
+}
+
+bool check_video(char *filename_utf8, double duration)
+{
+	AVFormatContext *fmt_ctx = NULL;
+	if(avformat_open_input(&fmt_ctx, filename_utf8, NULL, NULL) < 0)
+		return false;
+	if(avformat_find_stream_info(fmt_ctx, NULL) < 0)
+	{
+		avformat_close_input(&fmt_ctx);
+		return false;
+	}
+
+	int index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if(index < 0)
+	{
+		avformat_close_input(&fmt_ctx);
+		return false;
+	}
+
+	AVStream *stream = fmt_ctx -> streams[index];
+	const AVCodec *decoder = avcodec_find_decoder(stream -> codecpar -> codec_id);
+	if(!decoder)
+	{
+		avformat_close_input(&fmt_ctx);
+		return false;
+	}
+
+	AVCodecContext *codec_ctx = avcodec_alloc_context3(decoder);
+	AVPacket *packet = av_packet_alloc();
+	AVFrame *frame = av_frame_alloc();
+	if(!codec_ctx || !packet || !frame)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	bool ret = (avcodec_parameters_to_context(codec_ctx, stream -> codecpar) >= 0 &&
+	            avcodec_open2(codec_ctx, decoder, NULL) >= 0);
+	bool first_packet = true;
+	int64_t prev_dts = AV_NOPTS_VALUE, end_pts = 0;
+	while(ret && av_read_frame(fmt_ctx, packet) >= 0)
+	{
+		if(packet -> stream_index != index)
+		{
+			av_packet_unref(packet);
+			continue;
+		}
+
+		if(first_packet && !(packet -> flags & AV_PKT_FLAG_KEY))
+			ret = false;
+		if(prev_dts != AV_NOPTS_VALUE && packet -> dts <= prev_dts)
+			ret = false;
+		first_packet = false;
+		prev_dts = packet -> dts;
+		end_pts = FFMAX(end_pts, packet -> pts + packet -> duration);
+
+		if(ret && avcodec_send_packet(codec_ctx, packet) < 0)
+			ret = false;
+		while(ret)
+		{
+			int ret2 = avcodec_receive_frame(codec_ctx, frame);
+			if(ret2 == AVERROR(EAGAIN))
+				break;
+			else if(ret2 < 0 || frame -> width != codec_ctx -> width || frame -> height != codec_ctx -> height)
+				ret = false;
+			av_frame_unref(frame);
+		}
+		av_packet_unref(packet);
+	}
+
+	/* The length of the video stream should not differ from the expected duration by more than one second. */
+	if(first_packet || fabs(end_pts * av_q2d(stream -> time_base) - duration) > 1.0)
+		ret = false;
+
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	avcodec_free_context(&codec_ctx);
+	avformat_close_input(&fmt_ctx);
+	return ret;
+}
+
 bool write_blank_audio(AVInfo *video_info, int64_t begin_pts, int nb_frames)
 {
 	bool is_avi = false;
@@ -460,24 +1240,52 @@ bool write_blank_audio(AVInfo *video_info, int64_t begin_pts, int nb_frames)
 		return false;
 	}
 
+	AVPacket *packet_copy = av_packet_alloc();
+	if(!packet_copy)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
 	int64_t pts = begin_pts;
 	for(int frame = 0; frame < nb_frames; ++frame)
 	{
-		blank_audio_info -> packet -> stream_index = 0;
-		blank_audio_info -> packet -> pts = pts;
-		blank_audio_info -> packet -> dts = pts;
-		blank_audio_info -> packet -> duration = (is_avi ? MP3_framesize : AAC_framesize);
-		blank_audio_info -> packet -> pos = -1;
+		/* The muxer takes the packet, so write a new reference every time. */
+		if(av_packet_ref(packet_copy, blank_audio_info -> packet) < 0)
+		{
+			av_packet_free(&packet_copy);
+			AVInfo_free(blank_audio_info);
+			return false;
+		}
+		packet_copy -> stream_index = 0;
+		packet_copy -> pts = pts;
+		packet_copy -> dts = pts;
+		packet_copy -> duration = (is_avi ? MP3_framesize : AAC_framesize);
+		packet_copy -> pos = -1;
 		pts += (is_avi ? MP3_framesize : AAC_framesize);
 
-		if(av_write_frame(video_info -> fmt_ctx, blank_audio_info -> packet) < 0)
+		if(!write_packet(video_info, packet_copy))
+		{
+			av_packet_free(&packet_copy);
+			AVInfo_free(blank_audio_info);
 			return false;
+		}
 	}
 
+	av_packet_free(&packet_copy);
 	AVInfo_free(blank_audio_info);
 	return true;
 }
 
+bool write_packet(AVInfo *video_info, AVPacket *packet)
+{
+	EnterCriticalSection(&video_info -> lock);
+	int ret = av_interleaved_write_frame(video_info -> fmt_ctx, packet);
+	LeaveCriticalSection(&video_info -> lock);
+	return (ret >= 0);
+}
+
 bool AVInfo_write_to_fifo(AVAudioFifo *audio_fifo, AVFrame *frame)
 {
 	if(av_audio_fifo_space(audio_fifo) < frame -> nb_samples)
@@ -499,14 +1307,8 @@ bool AVInfo_write_to_fifo(AVAudioFifo *audio_fifo, AVFrame *frame)
 bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
                           AVAudioFifo *audio_fifo, enum AVSampleFormat fmt)
 {
-	struct SwrContext *swr_ctx = swr_alloc();
-	if(!swr_ctx)
-	{
-		VS_print_log(INSUFFICIENT_MEMORY);
-		system("pause >nul 2>&1");
-		abort();
-	}
-	
+	/* The resampler is taken from the cache when the format of the input is known. */
+	struct SwrContext *swr_ctx = NULL;
 	bool first_time = true, finished_reading = false;
 	int ret;
 	while(true)
@@ -517,7 +1319,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 		else if(ret < 0)
 		{
 			av_audio_fifo_free(audio_fifo);
-			swr_free(&swr_ctx);
+			release_resampler(swr_ctx, false);
 			return false;
 		}
 
@@ -527,7 +1329,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 			if(ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
 			{
 				av_audio_fifo_free(audio_fifo);
-				swr_free(&swr_ctx);
+				release_resampler(swr_ctx, false);
 				return false;
 			}
 
@@ -539,7 +1341,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 			else if(ret < 0)
 			{
 				av_audio_fifo_free(audio_fifo);
-				swr_free(&swr_ctx);
+				release_resampler(swr_ctx, false);
 				return false;
 			}
 		}
@@ -547,7 +1349,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 		if(finished_reading)
 		{
 			int ret1;
-			while(true)
+			while(swr_ctx)
 			{
 				ret1 = swr_convert(swr_ctx, (uint8_t **)video_info -> frame -> data,
 				                   video_info -> frame -> nb_samples, 0, 0);
@@ -558,7 +1360,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 				if(!AVInfo_write_to_fifo(audio_fifo, video_info -> frame))
 				{
 					av_audio_fifo_free(audio_fifo);
-					swr_free(&swr_ctx);
+					release_resampler(swr_ctx, false);
 					return false;
 				}
 			}		
@@ -585,22 +1387,13 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 		if(first_time)
 		{
 			av_channel_layout_default(&audio_info -> frame -> ch_layout, 2);
-			ret = swr_alloc_set_opts2(&swr_ctx, &video_info -> frame -> ch_layout, 
-									  fmt, video_info -> frame -> sample_rate,
-			                          &audio_info -> frame -> ch_layout,
-			                          (enum AVSampleFormat)(audio_info -> frame -> format),
-			                          audio_info -> frame -> sample_rate, 0, NULL);
-			if(ret < 0)
+			swr_ctx = acquire_resampler(&audio_info -> frame -> ch_layout, audio_info -> frame -> format,
+			                            audio_info -> frame -> sample_rate,
+			                            &video_info -> frame -> ch_layout, fmt,
+			                            video_info -> frame -> sample_rate);
+			if(!swr_ctx)
 			{
 				av_audio_fifo_free(audio_fifo);
-				swr_free(&swr_ctx);
-				return false;
-			}
-
-			if(swr_init(swr_ctx) < 0)
-			{
-				av_audio_fifo_free(audio_fifo);
-				swr_free(&swr_ctx);
 				return false;
 			}
 
@@ -614,7 +1407,7 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 		if(ret < 0)
 		{
 			av_audio_fifo_free(audio_fifo);
-			swr_free(&swr_ctx);
+			release_resampler(swr_ctx, false);
 			return false;
 		}
 		video_info -> frame -> nb_samples = ret;
@@ -622,12 +1415,12 @@ bool decode_audio_to_fifo(AVInfo *audio_info, AVInfo *video_info,
 		if(!AVInfo_write_to_fifo(audio_fifo, video_info -> frame))
 		{
 			av_audio_fifo_free(audio_fifo);
-			swr_free(&swr_ctx);
+			release_resampler(swr_ctx, false);
 			return false;
 		}	
 	}
 
-	swr_free(&swr_ctx);
+	release_resampler(swr_ctx, true);
 	return true;
 }
 
@@ -692,15 +1485,13 @@ int64_t encode_audio_from_fifo(AVInfo *video_info, AVAudioFifo *audio_fifo,
 		pts += video_info -> frame -> nb_samples;
 		video_info -> packet -> pos = -1;
 
-		ret = av_write_frame(video_info -> fmt_ctx, video_info -> packet);
-		if(ret < 0)
+		if(!write_packet(video_info, video_info -> packet))
 		{
 			av_audio_fifo_free(audio_fifo);
 			return 0;
 		}
 	}
 
-	ret = av_write_frame(video_info -> fmt_ctx, NULL);
 	return pts;
 }
 
@@ -0,0 +1,329 @@
+/** 
+ * VisualScores source file: converter.c
+ * Defines the cache of image scalers, audio resamplers and frame buffers shared by the whole program.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+
+#include "converter.h"
+#include "vslog.h"
+
+ConverterCache converter_cache;
+
+void converter_cache_init()
+{
+	converter_cache.nb_scalers = 0;
+	converter_cache.nb_resamplers = 0;
+	converter_cache.nb_frame_pools = 0;
+	converter_cache.frame_pool_clock = 0;
+	converter_cache.scaler_hits = 0;
+	converter_cache.scaler_misses = 0;
+	converter_cache.resampler_hits = 0;
+	converter_cache.resampler_misses = 0;
+	InitializeCriticalSection(&converter_cache.lock);
+}
+
+void converter_cache_free()
+{
+	for(int i = 0; i < converter_cache.nb_scalers; ++i)
+		sws_freeContext(converter_cache.scalers[i].sws_ctx);
+	for(int i = 0; i < converter_cache.nb_resamplers; ++i)
+		swr_free(&converter_cache.resamplers[i].swr_ctx);
+	for(int i = 0; i < converter_cache.nb_frame_pools; ++i)
+		av_buffer_pool_uninit(&converter_cache.frame_pools[i].pool);
+	converter_cache.nb_scalers = 0;
+	converter_cache.nb_resamplers = 0;
+	converter_cache.nb_frame_pools = 0;
+	DeleteCriticalSection(&converter_cache.lock);
+}
+
+struct SwsContext *acquire_scaler(int src_w, int src_h, int src_fmt,
+                                  int dst_w, int dst_h, int dst_fmt, int flags, int threads)
+{
+	ScalerKey key;
+	memset(&key, 0, sizeof(key));
+	key.src_w = src_w;  key.src_h = src_h;  key.src_fmt = src_fmt;
+	key.dst_w = dst_w;  key.dst_h = dst_h;  key.dst_fmt = dst_fmt;
+	key.flags = flags;
+	key.threads = threads;
+
+	EnterCriticalSection(&converter_cache.lock);
+	for(int i = 0; i < converter_cache.nb_scalers; ++i)
+	{
+		CachedScaler *scaler = &converter_cache.scalers[i];
+		if(!scaler -> in_use && memcmp(&scaler -> key, &key, sizeof(key)) == 0)
+		{
+			scaler -> in_use = true;
+			++converter_cache.scaler_hits;
+			LeaveCriticalSection(&converter_cache.lock);
+			return scaler -> sws_ctx;
+		}
+	}
+	++converter_cache.scaler_misses;
+	LeaveCriticalSection(&converter_cache.lock);
+
+	/* The context is built outside the lock since it takes a while. */
+	struct SwsContext *sws_ctx = sws_alloc_context();
+	if(!sws_ctx)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	av_opt_set_int(sws_ctx, "srcw", src_w, 0);
+	av_opt_set_int(sws_ctx, "srch", src_h, 0);
+	av_opt_set_int(sws_ctx, "src_format", src_fmt, 0);
+	av_opt_set_int(sws_ctx, "dstw", dst_w, 0);
+	av_opt_set_int(sws_ctx, "dsth", dst_h, 0);
+	av_opt_set_int(sws_ctx, "dst_format", dst_fmt, 0);
+	av_opt_set_int(sws_ctx, "sws_flags", flags, 0);
+	av_opt_set_int(sws_ctx, "threads", threads, 0);
+	if(sws_init_context(sws_ctx, NULL, NULL) < 0)
+	{
+		sws_freeContext(sws_ctx);
+		return NULL;
+	}
+
+	EnterCriticalSection(&converter_cache.lock);
+	int index = converter_cache.nb_scalers;
+	if(index == CONVERTER_LIMIT)
+	{
+		/* replace a scaler nobody is using */
+		for(index = 0; index < CONVERTER_LIMIT; ++index)
+			if(!converter_cache.scalers[index].in_use)
+				break;
+		if(index < CONVERTER_LIMIT)
+			sws_freeContext(converter_cache.scalers[index].sws_ctx);
+	}
+	else  ++converter_cache.nb_scalers;
+
+	if(index < CONVERTER_LIMIT)
+	{
+		converter_cache.scalers[index].key = key;
+		converter_cache.scalers[index].sws_ctx = sws_ctx;
+		converter_cache.scalers[index].in_use = true;
+	}
+	LeaveCriticalSection(&converter_cache.lock);
+	return sws_ctx;
+}
+
+void release_scaler(struct SwsContext *sws_ctx)
+{
+	if(sws_ctx == NULL)
+		return;
+
+	EnterCriticalSection(&converter_cache.lock);
+	for(int i = 0; i < converter_cache.nb_scalers; ++i)
+	{
+		if(converter_cache.scalers[i].sws_ctx == sws_ctx)
+		{
+			converter_cache.scalers[i].in_use = false;
+			LeaveCriticalSection(&converter_cache.lock);
+			return;
+		}
+	}
+	LeaveCriticalSection(&converter_cache.lock);
+
+	/* not cached because the cache was full */
+	sws_freeContext(sws_ctx);
+}
+
+bool scale_into_frame(struct SwsContext *sws_ctx, const AVFrame *src, AVFrame *frame, uint8_t **dest)
+{
+	/* The rectangle is given to swscale as a frame sharing the buffer of "frame". */
+	AVFrame *region = av_frame_alloc();
+	if(!region)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	int64_t width, height;
+	av_opt_get_int(sws_ctx, "dstw", 0, &width);
+	av_opt_get_int(sws_ctx, "dsth", 0, &height);
+	region -> format = frame -> format;
+	region -> width  = width;
+	region -> height = height;
+	for(int i = 0; i < 4 && dest[i] != NULL; ++i)
+	{
+		region -> data[i] = dest[i];
+		region -> linesize[i] = frame -> linesize[i];
+	}
+	region -> buf[0] = av_buffer_ref(frame -> buf[0]);
+	if(!region -> buf[0])
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	int ret = sws_scale_frame(sws_ctx, region, src);
+	av_frame_free(&region);
+	return ret >= 0;
+}
+
+struct SwrContext *acquire_resampler(AVChannelLayout *src_layout, int src_fmt, int src_rate,
+                                     AVChannelLayout *dst_layout, int dst_fmt, int dst_rate)
+{
+	ResamplerKey key;
+	memset(&key, 0, sizeof(key));
+	key.src_channels = src_layout -> nb_channels;  key.src_fmt = src_fmt;  key.src_rate = src_rate;
+	key.dst_channels = dst_layout -> nb_channels;  key.dst_fmt = dst_fmt;  key.dst_rate = dst_rate;
+
+	EnterCriticalSection(&converter_cache.lock);
+	for(int i = 0; i < converter_cache.nb_resamplers; ++i)
+	{
+		CachedResampler *resampler = &converter_cache.resamplers[i];
+		if(!resampler -> in_use && memcmp(&resampler -> key, &key, sizeof(key)) == 0)
+		{
+			resampler -> in_use = true;
+			++converter_cache.resampler_hits;
+			struct SwrContext *swr_ctx = resampler -> swr_ctx;
+			LeaveCriticalSection(&converter_cache.lock);
+
+			/* Initializing it again clears the state of the last stream but keeps its filter. */
+			if(swr_init(swr_ctx) < 0)
+			{
+				release_resampler(swr_ctx, false);
+				return NULL;
+			}
+			return swr_ctx;
+		}
+	}
+	++converter_cache.resampler_misses;
+	LeaveCriticalSection(&converter_cache.lock);
+
+	struct SwrContext *swr_ctx = NULL;
+	if(swr_alloc_set_opts2(&swr_ctx, dst_layout, dst_fmt, dst_rate,
+	                       src_layout, src_fmt, src_rate, 0, NULL) < 0)
+		return NULL;
+	if(swr_init(swr_ctx) < 0)
+	{
+		swr_free(&swr_ctx);
+		return NULL;
+	}
+
+	EnterCriticalSection(&converter_cache.lock);
+	int index = converter_cache.nb_resamplers;
+	if(index == CONVERTER_LIMIT)
+	{
+		for(index = 0; index < CONVERTER_LIMIT; ++index)
+			if(!converter_cache.resamplers[index].in_use)
+				break;
+		if(index < CONVERTER_LIMIT)
+			swr_free(&converter_cache.resamplers[index].swr_ctx);
+	}
+	else  ++converter_cache.nb_resamplers;
+
+	if(index < CONVERTER_LIMIT)
+	{
+		converter_cache.resamplers[index].key = key;
+		converter_cache.resamplers[index].swr_ctx = swr_ctx;
+		converter_cache.resamplers[index].in_use = true;
+	}
+	LeaveCriticalSection(&converter_cache.lock);
+	return swr_ctx;
+}
+
+void release_resampler(struct SwrContext *swr_ctx, bool reusable)
+{
+	if(swr_ctx == NULL)
+		return;
+
+	EnterCriticalSection(&converter_cache.lock);
+	for(int i = 0; i < converter_cache.nb_resamplers; ++i)
+	{
+		if(converter_cache.resamplers[i].swr_ctx == swr_ctx)
+		{
+			if(reusable)
+			{
+				converter_cache.resamplers[i].in_use = false;
+				LeaveCriticalSection(&converter_cache.lock);
+				return;
+			}
+
+			/* remove it from the cache */
+			converter_cache.resamplers[i] = converter_cache.resamplers[converter_cache.nb_resamplers - 1];
+			--converter_cache.nb_resamplers;
+			break;
+		}
+	}
+	LeaveCriticalSection(&converter_cache.lock);
+	swr_free(&swr_ctx);
+}
+
+bool get_pooled_buffer(AVFrame *frame, enum AVPixelFormat format, int width, int height)
+{
+	EnterCriticalSection(&converter_cache.lock);
+	FramePool *frame_pool = NULL;
+	for(int i = 0; i < converter_cache.nb_frame_pools; ++i)
+	{
+		FramePool *p = &converter_cache.frame_pools[i];
+		if(p -> format == format && p -> width == width && p -> height == height)
+		{
+			frame_pool = p;
+			break;
+		}
+	}
+
+	if(!frame_pool)
+	{
+		if(converter_cache.nb_frame_pools < FRAME_POOL_LIMIT)
+			frame_pool = &converter_cache.frame_pools[converter_cache.nb_frame_pools++];
+		else
+		{
+			/* buffers still held by frames stay valid; the old pool is freed after they return */
+			frame_pool = &converter_cache.frame_pools[0];
+			for(int i = 1; i < FRAME_POOL_LIMIT; ++i)
+				if(converter_cache.frame_pools[i].last_used < frame_pool -> last_used)
+					frame_pool = &converter_cache.frame_pools[i];
+			av_buffer_pool_uninit(&frame_pool -> pool);
+		}
+
+		/* the rows are aligned as "av_frame_get_buffer" does, with padding for SIMD reads past the end */
+		uint8_t *data[4];
+		frame_pool -> format = format;
+		frame_pool -> width  = width;
+		frame_pool -> height = height;
+		frame_pool -> size = -1;
+		if(av_image_fill_linesizes(frame_pool -> linesize, format, FFALIGN(width, 64)) >= 0)
+			frame_pool -> size = av_image_fill_pointers(data, format, height, NULL, frame_pool -> linesize);
+		frame_pool -> pool = (frame_pool -> size < 0) ? NULL : av_buffer_pool_init(frame_pool -> size + 64, NULL);
+		if(!frame_pool -> pool)
+		{
+			frame_pool -> width = frame_pool -> height = 0;  /* never matched again */
+			LeaveCriticalSection(&converter_cache.lock);
+			return false;
+		}
+	}
+	frame_pool -> last_used = ++converter_cache.frame_pool_clock;
+	/* Another thread may uninit the pool as soon as the lock is left; a buffer taken keeps it alive. */
+	AVBufferRef *buf = av_buffer_pool_get(frame_pool -> pool);
+	int linesize[4];
+	memcpy(linesize, frame_pool -> linesize, sizeof(linesize));
+	LeaveCriticalSection(&converter_cache.lock);
+
+	if(!buf)
+		return false;
+
+	av_frame_unref(frame);
+	frame -> format = format;
+	frame -> width  = width;
+	frame -> height = height;
+	frame -> buf[0] = buf;
+	for(int i = 0; i < 4; ++i)
+		frame -> linesize[i] = linesize[i];
+	av_image_fill_pointers(frame -> data, format, height, buf -> data, linesize);
+	frame -> extended_data = frame -> data;
+	return true;
+}
@@ -10,6 +10,11 @@
 #include <windows.h>
 #include <shellapi.h>
 #include <shlwapi.h>
+#include <process.h>
+
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
 
 #include "vslog.h"
 #include "visualscores.h"
@@ -34,21 +39,20 @@ void partition_audio(VisualScores *vs, wchar_t *cmd)
 		return;
 	}
 
-	VS_print_log(CREATING_BMP);
-	for(int i = begin - 1; i < end; ++i)
-	{
-		if( !AVInfo_create_bmp(vs -> image_info[vs -> image_pos[i]]) )
-		{
-			VS_print_log(FAILED_TO_CREATE_BMP);
-			system("forfiles /P resource\\ /M _display_*.bmp /C \"cmd /c del @file >nul 2>&1 \"");
-			return;
-		}
-	}
+	int rec_index[FILE_LIMIT];
+	/* Begin and end are defined at the beginning of this function. */
+	int size = fill_index(vs, begin - 1, end - 1, rec_index);
+	int total_partition = size - 1;
+
+	/* The previews are rendered while the wav file is created and the music counts down. */
+	VS_print_log(CREATING_PREVIEWS);
+	PreviewStore *store = preview_start(vs, rec_index, size);
 	
 	VS_print_log(CREATING_WAV);
 	if( !AVInfo_create_wav(vs -> audio_info[index - 1]) )
 	{
 		VS_print_log(FAILED_TO_CREATE_WAV);
+		preview_stop(store);
 		system("del resource\\audition.wav >nul 2>&1 ");
 		return;
 	}
@@ -60,7 +64,7 @@ void partition_audio(VisualScores *vs, wchar_t *cmd)
 	if(hWnd == NULL)
 	{
 		VS_print_log(FAILED_TO_DISPLAY);
-		system("forfiles /P resource\\ /M _display_*.bmp /C \"cmd /c del @file >nul 2>&1 \"");
+		preview_stop(store);
 		system("del resource\\audition.wav >nul 2>&1 ");
 		return;
 	}
@@ -78,7 +82,7 @@ void partition_audio(VisualScores *vs, wchar_t *cmd)
 	{
 		VS_print_log(FAILED_TO_DISPLAY);
 		ShowWindow(hWnd, SW_HIDE);
-		system("forfiles /P resource\\ /M _display_*.bmp /C \"cmd /c del @file >nul 2>&1 \"");
+		preview_stop(store);
 		system("del resource\\audition.wav >nul 2>&1 ");
 		return;
 	}
@@ -96,21 +100,22 @@ void partition_audio(VisualScores *vs, wchar_t *cmd)
 	if(!PlaySound("resource\\audition.wav", NULL, SND_FILENAME | SND_ASYNC))
 	{
 		VS_print_log(FAILED_TO_AUDITION);
-		system("forfiles /P resource\\ /M _display_*.bmp /C \"cmd /c del @file >nul 2>&1\"");
+		preview_stop(store);
 		system("del resource\\audition.wav >nul 2>&1 ");
 		return;
 	}
 	
 	DeleteObject(*hBitmap);
 	RedrawWindow(hWnd, NULL, NULL, RDW_ERASE | RDW_INVALIDATE);
-	wchar_t *bmp_filename = vs -> image_info[vs -> image_pos[begin - 1]] -> bmp_filename;
-	*hBitmap = LoadImageW(NULL, bmp_filename, IMAGE_BITMAP, 0, 0, LR_LOADFROMFILE);
+	*hBitmap = preview_take(store, vs -> image_pos[ rec_index[0] ]);
+	if(*hBitmap == NULL)
+	{
+		VS_print_log(FAILED_TO_CREATE_PREVIEWS);
+		escape_pressed(hWnd, hBitmap, store);
+		return;
+	}
 	do_painting(hWnd, hBitmap);
 
-	int rec_index[FILE_LIMIT];
-	/* Begin and end are defined at the beginning of this function. */
-	int size = fill_index(vs, begin - 1, end - 1, rec_index);
-	int total_partition = size - 1;
 	int partition_count = 0;
 	/* The actual playtime of the music lags somewhere behind the command 'PlaySound'. */
 	clock_t begin_time = clock() + (double)CLOCKS_PER_SEC / 2.0, prev_time = begin_time;
@@ -131,14 +136,14 @@ void partition_audio(VisualScores *vs, wchar_t *cmd)
 			case WM_HOTKEY:
 				if(msg.wParam == ID_ENTER)
 				{
-					bool ret = enter_pressed(hWnd, hBitmap, vs, vs -> audio_info[index - 1], 
+					bool ret = enter_pressed(hWnd, hBitmap, store, vs, vs -> audio_info[index - 1], 
 					                         &partition_count, total_partition, rec_index,
 					                         &begin_time, &prev_time, rec_duration);
 					if(ret)  return;
 				}
 				else if(msg.wParam == ID_ESCAPE)
 				{
-					escape_pressed(hWnd, hBitmap);
+					escape_pressed(hWnd, hBitmap, store);
 					return;
 				}
 				break;
@@ -221,13 +226,13 @@ void do_painting(HWND hWnd, HBITMAP *hBitmap)
 	EndPaint(hWnd, &ps);
 }
 
-bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, VisualScores *vs, AVInfo *audio_info, 
-                   int *partition_count, int total_partition, int *rec_index, 
+bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, PreviewStore *store, VisualScores *vs, 
+                   AVInfo *audio_info, int *partition_count, int total_partition, int *rec_index, 
                    clock_t *begin_time, clock_t *prev_time, double *rec_duration)
 {
 	if(*partition_count == total_partition)
 	{
-		escape_pressed(hWnd, hBitmap);
+		escape_pressed(hWnd, hBitmap, store);
 		settings(vs, L"");
 		return true;
 	}
@@ -238,14 +243,14 @@ bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, VisualScores *vs, AVInfo *audio_
 	rec_duration[*partition_count - 1] = ((cur_time - *prev_time) / (double)CLOCKS_PER_SEC);
 	*prev_time = cur_time;
 
-	wchar_t *bmp_filename = vs -> image_info[vs -> image_pos[ rec_index[*partition_count] ]] -> bmp_filename;
+	/* The preview is usually rendered by now; otherwise wait for it. */
 	DeleteObject(*hBitmap);
 	RedrawWindow(hWnd, NULL, NULL, RDW_ERASE | RDW_INVALIDATE);
-	*hBitmap = LoadImageW(NULL, bmp_filename, IMAGE_BITMAP, 0, 0, LR_LOADFROMFILE);
+	*hBitmap = preview_take(store, vs -> image_pos[ rec_index[*partition_count] ]);
 	if(*hBitmap == NULL)
 	{
-		VS_print_log(FAILED_TO_DISPLAY);
-		escape_pressed(hWnd, hBitmap);
+		VS_print_log(FAILED_TO_CREATE_PREVIEWS);
+		escape_pressed(hWnd, hBitmap, store);
 		return true;
 	}
 
@@ -254,7 +259,7 @@ bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, VisualScores *vs, AVInfo *audio_
 	if(total_time > audio_duration)
 	{
 		VS_print_log(TIMED_OUT);
-		escape_pressed(hWnd, hBitmap);
+		escape_pressed(hWnd, hBitmap, store);
 		return true;
 	}
 	if(*partition_count == total_partition)
@@ -269,11 +274,130 @@ bool enter_pressed(HWND hWnd, HBITMAP *hBitmap, VisualScores *vs, AVInfo *audio_
 	return false;
 }
 
-void escape_pressed(HWND hWnd, HBITMAP *hBitmap)
+PreviewStore *preview_start(VisualScores *vs, int *rec_index, int size)
+{
+	PreviewStore *store = calloc(1, sizeof(PreviewStore));
+	if(store == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	store -> vs = vs;
+
+	/* An image file repeated in the range is rendered once. */
+	bool queued[FILE_LIMIT] = {false};
+	for(int i = 0; i < size; ++i)
+	{
+		int index = vs -> image_pos[ rec_index[i] ];
+		if(!queued[index])
+		{
+			queued[index] = true;
+			/* a page edited since it was decoded is not shown from the source cache */
+			refresh_image(vs -> image_info[index]);
+			store -> jobs[store -> nb_jobs++] = index;
+		}
+	}
+
+	InitializeCriticalSection(&store -> lock);
+	InitializeConditionVariable(&store -> preview_ready);
+
+	store -> nb_workers = vs_config.workers;
+	if(store -> nb_workers == 0)
+		store -> nb_workers = av_cpu_count();
+	store -> nb_workers = FFMIN(FFMIN(store -> nb_workers, WORKER_LIMIT), FFMAX(1, store -> nb_jobs));
+	for(int i = 0; i < store -> nb_workers; ++i)
+	{
+		store -> workers[i] = (HANDLE)_beginthreadex(NULL, 0, preview_worker, store, 0, NULL);
+		if(store -> workers[i] == 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
+	return store;
+}
+
+unsigned __stdcall preview_worker(void *arg)
+{
+	PreviewStore *store = arg;
+	EnterCriticalSection(&store -> lock);
+	while(!store -> stopped && !store -> failed && store -> next_job < store -> nb_jobs)
+	{
+		int index = store -> jobs[store -> next_job];
+		++(store -> next_job);
+		LeaveCriticalSection(&store -> lock);
+
+		AVFrame *preview = av_frame_alloc();
+		if(!preview)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		if(!AVInfo_create_preview(store -> vs -> image_info[index], preview))
+			av_frame_free(&preview);
+
+		EnterCriticalSection(&store -> lock);
+		if(preview == NULL)
+			store -> failed = true;
+		else  store -> previews[index] = preview;
+		WakeAllConditionVariable(&store -> preview_ready);
+	}
+	LeaveCriticalSection(&store -> lock);
+	return 0;
+}
+
+HBITMAP preview_take(PreviewStore *store, int index)
+{
+	EnterCriticalSection(&store -> lock);
+	while(store -> previews[index] == NULL && !store -> failed)
+		SleepConditionVariableCS(&store -> preview_ready, &store -> lock, INFINITE);
+	AVFrame *preview = store -> previews[index];
+	LeaveCriticalSection(&store -> lock);
+	if(preview == NULL)
+		return NULL;
+
+	/* a top-down DIB in the pixel format of the preview */
+	BITMAPINFO bmi;
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = preview -> width;
+	bmi.bmiHeader.biHeight = -preview -> height;
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+	void *bits = NULL;
+	HBITMAP hBitmap = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+	if(hBitmap == NULL)
+		return NULL;
+	for(int y = 0; y < preview -> height; ++y)
+		memcpy((uint8_t *)bits + (size_t)y * 4 * preview -> width,
+		       preview -> data[0] + y * preview -> linesize[0], 4 * preview -> width);
+	return hBitmap;
+}
+
+void preview_stop(PreviewStore *store)
+{
+	EnterCriticalSection(&store -> lock);
+	store -> stopped = true;
+	LeaveCriticalSection(&store -> lock);
+
+	WaitForMultipleObjects(store -> nb_workers, store -> workers, TRUE, INFINITE);
+	for(int i = 0; i < store -> nb_workers; ++i)
+		CloseHandle(store -> workers[i]);
+	for(int i = 0; i < FILE_LIMIT; ++i)
+		av_frame_free(&store -> previews[i]);
+	DeleteCriticalSection(&store -> lock);
+	free(store);
+}
+
+void escape_pressed(HWND hWnd, HBITMAP *hBitmap, PreviewStore *store)
 {
 	ShowWindow(hWnd, SW_HIDE);
 	PlaySound(NULL, 0, 0);
-	system("forfiles /P resource\\ /M _display_*.bmp /C \"cmd /c del @file >nul 2>&1 \"");
+	preview_stop(store);
 	system("del resource\\audition.wav >nul 2>&1 ");
 	UnregisterHotKey(hWnd, ID_ENTER);
 	UnregisterHotKey(hWnd, ID_ESCAPE);
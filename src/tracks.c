@@ -71,6 +71,7 @@ void load(VisualScores *vs, wchar_t *cmd)
 	/* -1 is a placeholder. */
 	if(image_added)
 	{
+		refresh_image(vs -> image_info[vs -> image_count]);
 		++(vs -> image_count);
 		for(int i = vs -> image_count - 1; i > offset; --i)
 			vs -> image_pos[i] = vs -> image_pos[i - 1];
@@ -226,6 +227,7 @@ void load_all(VisualScores *vs, wchar_t *cmd)
 					/* -1 is a placeholder. */
 					if(added)
 					{
+						refresh_image(vs -> image_info[vs -> image_count]);
 						++(vs -> image_count);
 						++image_added;
 					}
@@ -412,6 +414,7 @@ void load_other(VisualScores *vs, wchar_t *cmd)
 		                         AVTYPE_BG_IMAGE, begin, end, -1, -1);
 		if(added)
 		{
+			refresh_image(vs -> bg_info[vs -> bg_count]);
 			++(vs -> bg_count);
 			VS_print_log(IMAGE_LOADED);
 			settings(vs, L"");
@@ -1047,3 +1050,62 @@ bool set_duration_parse_input(VisualScores *vs, wchar_t *cmd, int *index, double
 	
 	return true;
 }
+
+void set_blend_mode(VisualScores *vs, wchar_t *cmd)
+{
+	int index;
+	BlendMode mode;
+	bool valid = set_blend_mode_parse_input(vs, cmd, &index, &mode);
+	if(!valid)  return;
+
+	vs -> bg_info[index - 1] -> blend = mode;
+	VS_print_log(BLEND_MODE_SET);
+	settings(vs, L"");
+}
+
+bool set_blend_mode_parse_input(VisualScores *vs, wchar_t *cmd, int *index, BlendMode *mode)
+{
+	if(cmd[0] != L'B' || cmd[1] != L'G')
+	{
+		VS_print_log(INVALID_INPUT);
+		return false;
+	}
+
+	wchar_t str_index[10], str_mode[STRING_LIMIT];
+	size_t pos = 2;
+	while(pos < wcslen(cmd) && cmd[pos] != L' ')
+		++pos;
+	if(pos - 2 >= 10)
+	{
+		VS_print_log(INVALID_INPUT);
+		return false;
+	}
+	wcsncpy(str_index, cmd + 2, pos - 2);
+	str_index[pos - 2] = L'\0';
+
+	while(pos < wcslen(cmd) && cmd[pos] == L' ')
+		++pos;
+	wcscpy(str_mode, cmd + pos);
+
+	wchar_t *pEnd;
+	*index = wcstol(str_index, &pEnd, 10);
+	if(*pEnd != L'\0' || str_index[0] < '0' || str_index[0] > '9' 
+	   || *index <= 0 || *index > vs -> bg_count)
+	{
+		VS_print_log(INVALID_INPUT);
+		return false;
+	}
+
+	if(wcscmp(str_mode, L"darken") == 0)
+		*mode = BLEND_DARKEN;
+	else if(wcscmp(str_mode, L"multiply") == 0)
+		*mode = BLEND_MULTIPLY;
+	else if(wcscmp(str_mode, L"over") == 0)
+		*mode = BLEND_OVER;
+	else
+	{
+		VS_print_log(INVALID_INPUT);
+		return false;
+	}
+	return true;
+}
@@ -3,18 +3,24 @@
  * Defines functions which deal with exporting video.
  */
 
+#include <math.h>
+#include <process.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <windows.h>
+#include <psapi.h>
 #include <shlobj.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/audio_fifo.h>
+#include <libavutil/cpu.h>
 #include <libavutil/pixfmt.h>
 
+#include "converter.h"
 #include "vslog.h"
 #include "visualscores.h"
 
@@ -69,6 +75,40 @@ void get_video_filename(wchar_t *dest, wchar_t *src)
 }
 
 void export_video(VisualScores *vs, wchar_t *cmd)
+{
+	vs -> draft = (wcsncmp(cmd, L"draft", 5) == 0 && (cmd[5] == L'\0' || cmd[5] == L' '));
+	if(!vs -> draft)
+	{
+		write_video(vs, cmd);
+		return;
+	}
+
+	/**
+	 * A draft is exported with the options of the fastest export, which are restored after.
+	 * MPEG-4 writes still images with skipped frames, and each image is a single frame in 
+	 * mp4/mov files. 
+	 */
+	cmd += 5;
+	while(*cmd == L' ')
+		++cmd;
+	VSConfig saved_config = vs_config;
+	vs_config.codec = VSCODEC_MPEG4;
+	vs_config.vfr = true;
+	vs_config.quality = VSQUALITY_DRAFT;
+	if(!vs_config.draft_backgrounds)
+		vs_config.composite = VSCOMPOSITE_YUV;
+
+	/* The draft neither reuses nor replaces the packets kept for the next full export. */
+	EncodedImage *saved_encoded = vs -> encoded;
+	vs -> encoded = NULL;
+	write_video(vs, cmd);
+	free_encoded_images(vs -> encoded);
+	vs -> encoded = saved_encoded;
+	vs_config = saved_config;
+	vs -> draft = false;
+}
+
+void write_video(VisualScores *vs, wchar_t *cmd)
 {
 	if(vs -> image_count == 0)
 	{
@@ -76,6 +116,7 @@ void export_video(VisualScores *vs, wchar_t *cmd)
 		return;
 	}
 	
+	clock_t begin_time = clock();
 	double total_time = 0;
 	for(int i = 0; i < vs -> image_count; ++i)
 	{
@@ -98,32 +139,29 @@ void export_video(VisualScores *vs, wchar_t *cmd)
 		return;
 	}
 	
-	int width = 0, height = 0;
-	for(int i = 0; i < vs -> image_count; ++i)
-	{
-		if(vs -> image_info[i] -> width > width)
-			width = vs -> image_info[i] -> width;
-		if(vs -> image_info[i] -> height > height)
-			height = vs -> image_info[i] -> height;
-	}
-	for(int i = 0; i < vs -> bg_count; ++i)
-	{
-		if(vs -> bg_info[i] -> width > width)
-			width = vs -> bg_info[i] -> width;
-		if(vs -> bg_info[i] -> height > height)
-			height = vs -> bg_info[i] -> height;
-	}
-	
-	double scaling = FFMIN(1920.5, FFMAX(1280.0, (double)width)) / (double)width;
-	width = width * scaling;  /* In the range of 1280 to 1920. */
-	height = height * scaling;
-	/* It seems like swscale demands that width and height of the video file should be divisible by 4. */
-	width = (width + 2) / 4 * 4;
-	height = (height + 2) / 4 * 4;
-	
+	int width, height;
+	get_video_size(vs, &width, &height);
+	if(vs -> draft)
+		VS_print_log(DRAFT_EXPORT, width, height);
 	vs -> video_info = AVInfo_init();
 	AVInfo_open(vs -> video_info, filename, AVTYPE_VIDEO, -1, -1, width, height);
 	vs -> video_info -> fmt_ctx -> duration = (int64_t)(total_time * 1E6);
+	if(vs_config.vfr && !vs -> video_info -> vfr && !vs -> draft)
+		VS_print_log(VFR_NOT_SUPPORTED);
+	if(vs_config.codec == VSCODEC_H264 && vs -> video_info -> copy_frames)
+		VS_print_log(H264_NOT_AVAILABLE);
+	if(vs_config.composite == VSCOMPOSITE_YUV)
+	{
+		/* Blending over needs the alpha channel, which YUV420P does not have. */
+		bool over = false;
+		int bg_count = ((vs -> draft && !vs_config.draft_backgrounds) ? 0 : vs -> bg_count);
+		for(int i = 0; i < bg_count; ++i)
+			if(vs -> bg_info[i] -> blend == BLEND_OVER)
+				over = true;
+		if(over)
+			VS_print_log(YUV_COMPOSITE_NOT_SUPPORTED);
+		else  vs -> video_info -> compose_fmt = AV_PIX_FMT_YUV420P;
+	}
 
 	bool avio_opened = (!(vs -> video_info -> fmt_ctx -> oformat -> flags & AVFMT_NOFILE));
 	if(avio_opened && (avio_open(&vs -> video_info -> fmt_ctx -> pb,
@@ -141,20 +179,32 @@ void export_video(VisualScores *vs, wchar_t *cmd)
 		return;
 	}
 
-	if(!write_image_track(vs))
+	MemoryMonitor memory_monitor;
+	memory_monitor_start(&memory_monitor);
+
+	/* The audio track is written by another thread; the muxer interleaves the packets. */
+	HANDLE audio_thread = (HANDLE)_beginthreadex(NULL, 0, audio_track_worker, vs, 0, NULL);
+	if(audio_thread == 0)
 	{
-		VS_print_log(FAILED_TO_EXPORT);
-		AVInfo_free(vs -> video_info);
-		return;
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
 	}
 
-	if(!write_audio_track(vs))
+	bool image_written = write_image_track(vs);
+	DWORD audio_written = 0;
+	WaitForSingleObject(audio_thread, INFINITE);
+	GetExitCodeThread(audio_thread, &audio_written);
+	CloseHandle(audio_thread);
+	size_t peak_memory = memory_monitor_stop(&memory_monitor);
+	if(!image_written || !audio_written)
 	{
 		VS_print_log(FAILED_TO_EXPORT);
 		AVInfo_free(vs -> video_info);
 		return;
 	}
 
+	print_bitrates(vs);
 	if(av_write_trailer(vs -> video_info -> fmt_ctx) < 0)
 	{
 		VS_print_log(FAILED_TO_EXPORT);
@@ -162,65 +212,1136 @@ void export_video(VisualScores *vs, wchar_t *cmd)
 		return;
 	}
 
+	/* Frames with long duration are unusual, so make sure the file can still be played. */
+	bool vfr = vs -> video_info -> vfr;
+	char filename_utf8[sizeof(wchar_t) * STRING_LIMIT];
+	strcpy_s(filename_utf8, sizeof(wchar_t) * STRING_LIMIT, vs -> video_info -> filename_utf8);
 	AVInfo_free(vs -> video_info);
+	if(vfr && !check_video(filename_utf8, total_time))
+		VS_print_log(PLAYBACK_CHECK_FAILED);
+	VS_print_log(TIME_ELAPSED, (double)(clock() - begin_time) / CLOCKS_PER_SEC);
+	VS_print_log(PEAK_MEMORY, peak_memory / 1048576.0);
+	VS_print_log(CONVERTER_CACHE_STATS, converter_cache.scaler_hits, converter_cache.scaler_misses,
+	             converter_cache.resampler_hits, converter_cache.resampler_misses);
+	VS_print_log(SOURCE_CACHE_STATS, source_cache.hits, source_cache.misses, source_cache.in_use / 1048576.0);
 	VS_print_log(VIDEO_EXPORTED);
 }
 
+void get_video_size(VisualScores *vs, int *video_w, int *video_h)
+{
+	int width = 0, height = 0;
+	for(int i = 0; i < vs -> image_count; ++i)
+	{
+		if(vs -> image_info[i] -> width > width)
+			width = vs -> image_info[i] -> width;
+		if(vs -> image_info[i] -> height > height)
+			height = vs -> image_info[i] -> height;
+	}
+	for(int i = 0; i < vs -> bg_count; ++i)
+	{
+		if(vs -> bg_info[i] -> width > width)
+			width = vs -> bg_info[i] -> width;
+		if(vs -> bg_info[i] -> height > height)
+			height = vs -> bg_info[i] -> height;
+	}
+	
+	/* In the range of 1280 to 1920 unless the resolution is set. */
+	double scaling = FFMIN(1920.5, FFMAX(1280.0, (double)width)) / (double)width;
+	if(vs_config.video_width > 0)
+		scaling = (double)vs_config.video_width / width;
+	else if(vs_config.video_height > 0)
+		scaling = (double)vs_config.video_height / height;
+	width = width * scaling;
+	height = height * scaling;
+	/* It seems like swscale demands that width and height of the video file should be divisible by 4. */
+	*video_w = (width + 2) / 4 * 4;
+	*video_h = (height + 2) / 4 * 4;
+	if(vs -> draft)
+	{
+		*video_h = FFMAX((int)((double)*video_h * DRAFT_WIDTH / *video_w + 2) / 4 * 4, 4);
+		*video_w = DRAFT_WIDTH;
+	}
+}
+
 bool write_image_track(VisualScores *vs)
 {
 	int rec_index[FILE_LIMIT];
 	int size = fill_index(vs, 0, vs -> image_count - 1, rec_index);
+	int64_t begin_ticks[FILE_LIMIT + 1];
+	fill_ticks(vs, rec_index, size, begin_ticks);
+
+	for(int i = 0; i < vs -> image_count; ++i)
+		refresh_image(vs -> image_info[i]);
+	for(int j = 0; j < vs -> bg_count; ++j)
+		refresh_image(vs -> bg_info[j]);
+	build_bg_index(vs);
+	EncodedImage *reuse[FILE_LIMIT];
+	EncodedImage *prev_encoded = prepare_encoded_images(vs, rec_index, begin_ticks, size, reuse);
+
+	int nb_segments = vs_config.segments;
+	if(nb_segments == 0)
+		nb_segments = av_cpu_count();
+	nb_segments = FFMIN(FFMIN(nb_segments, size), WORKER_LIMIT);
+	bool ret;
+	if(nb_segments > 1)
+		ret = write_segments(vs, rec_index, begin_ticks, reuse, size, nb_segments);
+	else
+	{
+		count_background_uses(vs, rec_index, reuse, size);
+		ret = write_image_sequence(vs, rec_index, begin_ticks, reuse, size);
+	}
+	free_encoded_images(prev_encoded);
+	release_backgrounds(vs);
+	return ret;
+}
+
+void build_bg_index(VisualScores *vs)
+{
+	/* Drafts leave out background images unless asked; the index is then empty. */
+	int bg_count = ((vs -> draft && !vs_config.draft_backgrounds) ? 0 : vs -> bg_count);
+
+	/* The background images of position "pos" are "bg_list[bg_offset[pos]]" to "bg_list[bg_offset[pos + 1] - 1]". */
+	for(int pos = 0; pos <= FILE_LIMIT; ++pos)
+		vs -> bg_offset[pos] = 0;
+	for(int j = 0; j < bg_count; ++j)
+	{
+		int begin = FFMAX(vs -> bg_info[j] -> begin - 1, 0);
+		int end = FFMIN(vs -> bg_info[j] -> end - 1, FILE_LIMIT - 1);
+		for(int pos = begin; pos <= end; ++pos)
+			++(vs -> bg_offset[pos + 1]);
+	}
+	for(int pos = 0; pos < FILE_LIMIT; ++pos)
+		vs -> bg_offset[pos + 1] += vs -> bg_offset[pos];
+
+	free(vs -> bg_list);
+	vs -> bg_list = malloc(sizeof(int) * FFMAX(vs -> bg_offset[FILE_LIMIT], 1));
+	if(vs -> bg_list == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	int filled[FILE_LIMIT];
+	for(int pos = 0; pos < FILE_LIMIT; ++pos)
+		filled[pos] = vs -> bg_offset[pos];
+	/* in the order of the background track, which is the order of blending */
+	for(int j = 0; j < bg_count; ++j)
+	{
+		int begin = FFMAX(vs -> bg_info[j] -> begin - 1, 0);
+		int end = FFMIN(vs -> bg_info[j] -> end - 1, FILE_LIMIT - 1);
+		for(int pos = begin; pos <= end; ++pos)
+			vs -> bg_list[ filled[pos]++ ] = j;
+	}
+
+	release_backgrounds(vs);
+}
+
+void count_background_uses(VisualScores *vs, int *rec_index, EncodedImage **reuse, int size)
+{
+	/* A position is composed at its first appearance which is not reused, as by the pipeline. */
+	bool composed[FILE_LIMIT] = {false};
+	for(int i = 0; i < size; ++i)
+	{
+		int pos = rec_index[i];
+		if(reuse[i] != NULL || composed[pos])
+			continue;
+		composed[pos] = true;
+		int bg_pos = vs -> image_pos[pos];
+		for(int k = vs -> bg_offset[bg_pos]; k < vs -> bg_offset[bg_pos + 1]; ++k)
+			++(vs -> bg_info[ vs -> bg_list[k] ] -> bg_uses);
+	}
+}
+
+void release_backgrounds(VisualScores *vs)
+{
+	for(int j = 0; j < vs -> bg_count; ++j)
+	{
+		vs -> bg_info[j] -> bg_uses = 0;
+		av_frame_free(&vs -> bg_info[j] -> rendered);
+		av_frame_free(&vs -> bg_info[j] -> rendered_gray);
+	}
+}
+
+void memory_monitor_start(MemoryMonitor *monitor)
+{
+	monitor -> peak = 0;
+	monitor -> stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if(monitor -> stop == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	monitor -> thread = (HANDLE)_beginthreadex(NULL, 0, memory_monitor_worker, monitor, 0, NULL);
+	if(monitor -> thread == 0)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+}
+
+unsigned __stdcall memory_monitor_worker(void *arg)
+{
+	MemoryMonitor *monitor = arg;
+	do
+	{
+		PROCESS_MEMORY_COUNTERS memory_counters;
+		if(GetProcessMemoryInfo(GetCurrentProcess(), &memory_counters, sizeof(memory_counters)))
+			monitor -> peak = FFMAX(monitor -> peak, memory_counters.WorkingSetSize);
+	} while(WaitForSingleObject(monitor -> stop, MEMORY_SAMPLE_INTERVAL) == WAIT_TIMEOUT);
+	return 0;
+}
+
+size_t memory_monitor_stop(MemoryMonitor *monitor)
+{
+	SetEvent(monitor -> stop);
+	WaitForSingleObject(monitor -> thread, INFINITE);
+	CloseHandle(monitor -> thread);
+	CloseHandle(monitor -> stop);
+	return monitor -> peak;
+}
+
+void print_bitrates(VisualScores *vs)
+{
+	double seconds_per_tick = av_q2d(vs -> video_info -> codec_ctx2 -> time_base);
+	int64_t total_bytes = 0, total_ticks = 0;
+
+	VS_print_log(BITRATE_HEAD);
+	for(int pos = 0; pos < vs -> image_count; ++pos)
+	{
+		EncodedImage *encoded = &vs -> encoded[pos];
+		if(encoded -> ticks_written == 0)
+			continue;
+		total_bytes += encoded -> bytes_written;
+		total_ticks += encoded -> ticks_written;
+		VS_print_log(BITRATE_OF_IMAGE, pos + 1, 
+		             encoded -> bytes_written * 8.0 / (encoded -> ticks_written * seconds_per_tick) / 1000.0);
+	}
+	if(total_ticks > 0)
+		VS_print_log(BITRATE_TOTAL, total_bytes * 8.0 / (total_ticks * seconds_per_tick) / 1000.0);
+}
+
+void benchmark(VisualScores *vs, wchar_t *cmd)
+{
+	if(vs -> image_count == 0)
+	{
+		VS_print_log(IMAGE_NOT_LOADED);
+		return;
+	}
+
+	int width, height;
+	get_video_size(vs, &width, &height);
+	/* Scaling is timed on 1, 2, 4, ... threads up to the number of cores. */
+	int nb_cores = av_cpu_count();
+	int thread_counts[32], nb_steps = 0;
+	for(int threads = 1; threads <= nb_cores && nb_steps < 32;
+	    threads = ((threads < nb_cores && threads * 2 > nb_cores) ? nb_cores : threads * 2))
+		thread_counts[nb_steps++] = threads;
+
+	/**
+	 * Each image is decoded once, outside the timer, and scaled as in export by every tier and
+	 * thread count. The tiers are compared with the output of Lanczos.
+	 */
+	const VSQuality tiers[3] = {VSQUALITY_HIGH, VSQUALITY_STANDARD, VSQUALITY_DRAFT};
+	double tier_seconds[3] = {0}, thread_seconds[32] = {0}, squared_error[3] = {0};
+	int64_t nb_pixels = 0;
+	int saved_threads = vs_config.scaler_threads;
+	AVFrame *src = av_frame_alloc(), *reference = av_frame_alloc(), *frame = av_frame_alloc();
+	if(!src || !reference || !frame)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	bool ret = true;
+	for(int i = 0; i < vs -> image_count && ret; ++i)
+	{
+		AVInfo *image_info = vs -> image_info[i];
+		refresh_image(image_info);
+		ret = decode_source(image_info);
+		if(ret && av_frame_ref(src, image_info -> frame) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		release_source(image_info);
+		AVInfo_reopen_input(image_info);
+
+		vs_config.scaler_threads = saved_threads;
+		for(int t = 0; t < 3 && ret; ++t)
+		{
+			ret = time_scaling(src, (t == 0 ? reference : frame), width, height, tiers[t], &tier_seconds[t]);
+			if(ret && t > 0)
+				squared_error[t] += frame_squared_error(frame, reference);
+			av_frame_unref(frame);
+		}
+		if(ret)
+			nb_pixels += (int64_t)reference -> width * reference -> height;
+		av_frame_unref(reference);
+
+		for(int k = 0; k < nb_steps && ret; ++k)
+		{
+			vs_config.scaler_threads = thread_counts[k];
+			ret = time_scaling(src, frame, width, height, VSQUALITY_HIGH, &thread_seconds[k]);
+			av_frame_unref(frame);
+		}
+		av_frame_unref(src);
+		if(!ret)
+			VS_print_log(BENCHMARK_FAILED, i + 1);
+	}
+	vs_config.scaler_threads = saved_threads;
+	av_frame_free(&src);
+	av_frame_free(&reference);
+	av_frame_free(&frame);
+	if(!ret)
+		return;
+
+	VS_print_log(BENCHMARK_HEAD, vs -> image_count, width, height);
+	VS_print_log(BENCHMARK_REFERENCE, quality_name(tiers[0]), tier_seconds[0]);
+	for(int t = 1; t < 3; ++t)
+	{
+		/* The alpha channel is left out. */
+		double mse = squared_error[t] / (3.0 * nb_pixels);
+		double psnr = (mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.99);
+		VS_print_log(BENCHMARK_TIER, quality_name(tiers[t]), tier_seconds[t], psnr);
+	}
+	VS_print_log(BENCHMARK_THREADS_HEAD);
+	for(int k = 0; k < nb_steps; ++k)
+		VS_print_log(BENCHMARK_THREADS, thread_counts[k], thread_seconds[k]);
+
+	/**
+	 * Every image is encoded for one second of constant frame rate as in an export without 
+	 * copied packets, on 1, 2, 4, ... encoder threads up to the number of cores.
+	 */
+	AVFrame **frames = malloc(sizeof(AVFrame*) * vs -> image_count);
+	if(frames == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	for(int i = 0; i < vs -> image_count; ++i)
+	{
+		frames[i] = av_frame_alloc();
+		if(!frames[i])
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		bool decoded = decode_image(vs -> image_info[i], frames[i], width, height, AV_PIX_FMT_YUV420P, vs_config.quality);
+		AVInfo_reopen_input(vs -> image_info[i]);
+		if(!decoded)
+		{
+			VS_print_log(BENCHMARK_FAILED, i + 1);
+			for(int j = 0; j <= i; ++j)
+				av_frame_free(&frames[j]);
+			free(frames);
+			return;
+		}
+	}
+
+	int nb_frames = vs -> image_count * (int)VS_framerate;
+	int saved_encoder_threads = vs_config.threads;
+	bool head_printed = false;
+	for(int threads = 1; threads <= nb_cores;
+	    threads = ((threads < nb_cores && threads * 2 > nb_cores) ? nb_cores : threads * 2))
+	{
+		vs_config.threads = threads;
+		AVInfo *encoder_info = AVInfo_init();
+		encoder_info -> type = AVTYPE_VIDEO;
+		encoder_info -> width = width;
+		encoder_info -> height = height;
+		if(!AVInfo_open_video_encoder(encoder_info, false))
+		{
+			AVInfo_free(encoder_info);
+			break;
+		}
+		if(!head_printed)
+		{
+			VS_print_log(BENCHMARK_ENCODER_HEAD, nb_frames, (encoder_info -> copy_frames ? L"MPEG-4" : L"H.264"));
+			if(encoder_info -> copy_frames && !(vs_config.thread_type & FF_THREAD_SLICE))
+				VS_print_log(MPEG4_SLICE_THREADS);
+		}
+		head_printed = true;
+
+		clock_t begin_time = clock();
+		bool encoded = encode_frames(encoder_info, frames, vs -> image_count, (int)VS_framerate);
+		double seconds = (double)(clock() - begin_time) / CLOCKS_PER_SEC;
+		AVInfo_free(encoder_info);
+		if(!encoded)
+			break;
+		VS_print_log(BENCHMARK_ENCODER, threads, seconds, (seconds > 0 ? nb_frames / seconds : 0.0));
+	}
+	vs_config.threads = saved_encoder_threads;
+	for(int i = 0; i < vs -> image_count; ++i)
+		av_frame_free(&frames[i]);
+	free(frames);
+
+	/* the 25 fps frames of a 10000-second video */
+	const int nb_packets = 250000;
+	VS_print_log(BENCHMARK_PACKETS, nb_packets, packet_overhead(false, nb_packets), packet_overhead(true, nb_packets));
+	if(!muted)  wprintf(L"\n");
+}
+
+bool encode_frames(AVInfo *encoder_info, AVFrame **frames, int nb_images, int frames_per_image)
+{
+	AVCodecContext *codec_ctx = encoder_info -> codec_ctx2;
+	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	/* The quantizer of a fixed quality encoder is taken from the frame, as in "encode_image". */
+	for(int i = 0; i < nb_images; ++i)
+		frames[i] -> quality = codec_ctx -> global_quality;
+
+	bool ret = true;
+	int64_t pts = 0;
+	for(int i = 0; i <= nb_images * frames_per_image && ret; ++i)
+	{
+		/* The last round drains the encoder. */
+		AVFrame *frame = NULL;
+		if(i < nb_images * frames_per_image)
+		{
+			frame = frames[i / frames_per_image];
+			frame -> pts = pts++;
+			frame -> pict_type = (i % frames_per_image == 0 ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE);
+		}
+		if(avcodec_send_frame(codec_ctx, frame) < 0)
+			ret = false;
+		while(ret)
+		{
+			int ret2 = avcodec_receive_packet(codec_ctx, packet);
+			if(ret2 == AVERROR(EAGAIN) || ret2 == AVERROR_EOF)
+				break;
+			else if(ret2 < 0)
+				ret = false;
+			av_packet_unref(packet);
+		}
+	}
+	for(int i = 0; i < nb_images; ++i)
+		frames[i] -> pict_type = AV_PICTURE_TYPE_NONE;
+	av_packet_free(&packet);
+	return ret;
+}
+
+double packet_overhead(bool reuse, int nb_packets)
+{
+	/**
+	 * Still images of 3 seconds at 25 fps whose packets are copied, each with a packet of its 
+	 * own as given by the encoder. The muxer is a packet which takes the reference and drops it.
+	 */
+	const int frames_per_image = 75;
+	int nb_images = (nb_packets + frames_per_image - 1) / frames_per_image;
+	AVPacket **sources = packet_array_alloc(nb_images);
+	AVPacket *original = av_packet_alloc();
+	AVPacket *packet = av_packet_alloc();
+	AVPacket *muxed = av_packet_alloc();
+	if(!original || !packet || !muxed || av_new_packet(original, 4096) < 0)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+	for(int i = 0; i < nb_images; ++i)
+	{
+		if(av_packet_ref(sources[i], original) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
+
+	/* the time bases of a 25 fps video in MP4 */
+	AVRational codec_tb = {1, 25}, stream_tb = {1, 12800};
+	int64_t scale = av_div_q(codec_tb, stream_tb).num, pts = 0;
+	clock_t begin_time = clock();
+	for(int i = 0; i < nb_packets; ++i)
+	{
+		AVPacket *source = sources[i / frames_per_image];
+		bool last = (i % frames_per_image == frames_per_image - 1 || i == nb_packets - 1);
+		AVPacket *copy = packet;
+		if(reuse)
+		{
+			/* as "write_image_packets" does now: one packet, moved for the last frame of the image */
+			if(last)
+				av_packet_move_ref(copy, source);
+			else if(av_packet_ref(copy, source) < 0)
+				copy = NULL;
+			if(copy)
+			{
+				copy -> pts = copy -> dts = pts;
+				copy -> duration = scale;
+				pts += scale;
+			}
+		}
+		else
+		{
+			/* as it did before: a new reference in a new packet for every frame */
+			copy = av_packet_alloc();
+			if(copy && av_packet_ref(copy, source) < 0)
+				av_packet_free(&copy);
+			if(copy)
+			{
+				copy -> pts = copy -> dts = av_rescale_q(i, codec_tb, stream_tb);
+				copy -> duration = av_rescale_q(1, codec_tb, stream_tb);
+			}
+		}
+		if(!copy)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+
+		av_packet_move_ref(muxed, copy);
+		av_packet_unref(muxed);
+		if(!reuse)
+			av_packet_free(&copy);
+	}
+	double seconds = (double)(clock() - begin_time) / CLOCKS_PER_SEC;
+
+	packet_array_free(&sources, nb_images);
+	av_packet_free(&original);
+	av_packet_free(&packet);
+	av_packet_free(&muxed);
+	return seconds * 1e9 / nb_packets;
+}
+
+bool time_scaling(AVFrame *src, AVFrame *frame, int width, int height, VSQuality quality, double *seconds)
+{
+	int scaled_w, scaled_h;
+	fit_image(src -> width, src -> height, width, height, &scaled_w, &scaled_h);
+	frame -> format = AV_PIX_FMT_RGBA;
+	frame -> width = scaled_w;
+	frame -> height = scaled_h;
+	if(av_frame_get_buffer(frame, 0) < 0)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	/* Building the context, with its filter tables and threads, is left out of the time. */
+	struct SwsContext *sws_ctx = acquire_scaler(src -> width, src -> height, src -> format,
+	                                            scaled_w, scaled_h, AV_PIX_FMT_RGBA,
+	                                            scaler_flags(quality, src -> width, src -> height, scaled_w, scaled_h),
+	                                            vs_config.scaler_threads);
+	if(!sws_ctx)
+		return false;
+	clock_t begin_time = clock();
+	bool ret = scale_into_frame(sws_ctx, src, frame, frame -> data);
+	*seconds += (double)(clock() - begin_time) / CLOCKS_PER_SEC;
+	release_scaler(sws_ctx);
+	return ret;
+}
+
+double frame_squared_error(AVFrame *frame1, AVFrame *frame2)
+{
+	double sum = 0;
+	for(int y = 0; y < frame1 -> height; ++y)
+	{
+		uint8_t *row1 = frame1 -> data[0] + y * frame1 -> linesize[0];
+		uint8_t *row2 = frame2 -> data[0] + y * frame2 -> linesize[0];
+		int64_t row_sum = 0;
+		for(int x = 0; x < 4 * frame1 -> width; ++x)
+		{
+			if(x % 4 == 3)
+				continue;
+			int diff = row1[x] - row2[x];
+			row_sum += diff * diff;
+		}
+		sum += row_sum;
+	}
+	return sum;
+}
+
+bool write_image_sequence(VisualScores *vs, int *rec_index, int64_t *begin_ticks, 
+                          EncodedImage **reuse, int size)
+{
+	ExportPipeline *pipeline = pipeline_start(vs, rec_index, reuse, size);
+	for(int i = 0; i < size; ++i)
+	{
+		VS_print_log(WRITING_IMAGE_TRACK, i + 1, size);
+
+		int pos = rec_index[i];
+		int64_t nb_ticks = begin_ticks[i + 1] - begin_ticks[i];
+		if(reuse[i] != NULL)
+		{
+			if(!reuse_image(vs -> video_info, reuse[i], begin_ticks[i], nb_ticks, &vs -> encoded[pos]))
+			{
+				pipeline_stop(pipeline);
+				return false;
+			}
+			continue;
+		}
+
+		if(!pipeline_take(pipeline, i, vs -> video_info -> frame2))
+		{
+			pipeline_stop(pipeline);
+			return false;
+		}
+
+		if(!encode_image(vs -> video_info, begin_ticks[i], nb_ticks, &vs -> encoded[pos]))
+		{
+			pipeline_stop(pipeline);
+			return false;
+		}
+		av_frame_unref(vs -> video_info -> frame2);
+	}
+	pipeline_stop(pipeline);
+	return flush_image_encoder(vs -> video_info);
+}
+
+EncodedImage *prepare_encoded_images(VisualScores *vs, int *rec_index, int64_t *begin_ticks,
+                                     int size, EncodedImage **reuse)
+{
+	EncodedImage *prev_encoded = vs -> encoded;
+	vs -> encoded = calloc(FILE_LIMIT, sizeof(EncodedImage));
+	if(vs -> encoded == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	uint64_t bg_hash[FILE_LIMIT];
+	for(int j = 0; j < vs -> bg_count; ++j)
+		bg_hash[j] = vs -> bg_info[j] -> content_hash;
+
+	int nb_reused = 0;
+	for(int i = 0; i < size; ++i)
+	{
+		int pos = rec_index[i];
+		/* the packets of a draft are not kept */
+		if(vs -> encoded[pos].key == 0 && !vs -> draft)
+			vs -> encoded[pos].key = image_cache_key(vs, pos, bg_hash);
+
+		reuse[i] = find_encoded_image(prev_encoded, vs -> encoded[pos].key);
+		int64_t nb_ticks = begin_ticks[i + 1] - begin_ticks[i];
+		if(reuse[i] != NULL && !can_reuse_image(vs -> video_info, reuse[i], nb_ticks))
+			reuse[i] = NULL;
+		/* The reused packets come from another encoder than the images around them. */
+		if(reuse[i] != NULL && (!can_join_images(vs -> video_info, ticks_written_before(begin_ticks, i)) ||
+		                        !can_join_images(vs -> video_info, nb_ticks)))
+			reuse[i] = NULL;
+		if(reuse[i] != NULL)
+			++nb_reused;
+	}
+	if(nb_reused > 0)
+		VS_print_log(IMAGES_REUSED, nb_reused, size);
+	return prev_encoded;
+}
+
+int64_t ticks_written_before(int64_t *begin_ticks, int index)
+{
+	for(int i = index - 1; i >= 0; --i)
+		if(begin_ticks[i + 1] > begin_ticks[i])
+			return begin_ticks[i + 1] - begin_ticks[i];
+	return 0;
+}
+
+uint64_t image_cache_key(VisualScores *vs, int pos, uint64_t *bg_hash)
+{
+	AVInfo *image_info = vs -> image_info[vs -> image_pos[pos]];
+	uint64_t content = image_info -> content_hash;
+	if(content == 0)
+		return 0;
+
+	/* Anything that changes the encoded packets, but not the timing, which is set when writing. */
+	uint64_t key = hash_bytes(HASH_SEED, &content, sizeof(content));
+	int bg_pos = vs -> image_pos[pos];
+	for(int k = vs -> bg_offset[bg_pos]; k < vs -> bg_offset[bg_pos + 1]; ++k)
+	{
+		int j = vs -> bg_list[k];
+		if(bg_hash[j] == 0)
+			return 0;
+		key = hash_bytes(key, &bg_hash[j], sizeof(bg_hash[j]));
+		key = hash_bytes(key, &vs -> bg_info[j] -> blend, sizeof(vs -> bg_info[j] -> blend));
+	}
+
+	AVCodecContext *codec_ctx = vs -> video_info -> codec_ctx2;
+	int settings[] = {codec_ctx -> codec_id, codec_ctx -> width, codec_ctx -> height, 
+	                  codec_ctx -> pix_fmt, codec_ctx -> gop_size, vs -> video_info -> vfr,
+	                  vs_config.qscale, vs_config.crf, vs -> video_info -> compose_fmt, vs_config.quality,
+	                  vs_config.gray_pages};
+	key = hash_bytes(key, settings, sizeof(settings));
+	return (key == 0 ? 1 : key);
+}
+
+EncodedImage *find_encoded_image(EncodedImage *encoded, uint64_t key)
+{
+	if(encoded == NULL || key == 0)
+		return NULL;
+	for(int i = 0; i < FILE_LIMIT; ++i)
+		if(encoded[i].key == key && encoded[i].nb_packets > 0)
+			return &encoded[i];
+	return NULL;
+}
+
+void free_encoded_images(EncodedImage *encoded)
+{
+	if(encoded == NULL)
+		return;
+	for(int i = 0; i < FILE_LIMIT; ++i)
+		packet_array_free(&encoded[i].packets, encoded[i].nb_packets);
+	free(encoded);
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	/* FNV-1a */
+	const uint8_t *bytes = data;
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+void refresh_image(AVInfo *image_info)
+{
+	uint64_t hash = hash_file(image_info -> filename);
+	if(hash != 0 && hash == image_info -> content_hash)
+		return;
+
+	/* The file was changed since it was decoded, so the decoded image and its color are stale. */
+	image_info -> content_hash = hash;
+	source_cache_remove(image_info);
+	detect_gray(image_info);
+}
+
+uint64_t hash_file(wchar_t *filename)
+{
+	FILE *fp = NULL;
+	if(_wfopen_s(&fp, filename, L"rb") != 0 || fp == NULL)
+		return 0;
+
+	uint8_t buffer[65536];
+	uint64_t hash = HASH_SEED;
+	size_t size;
+	while((size = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		hash = hash_bytes(hash, buffer, size);
+	bool failed = ferror(fp);
+	fclose(fp);
+	return (failed || hash == 0 ? 0 : hash);
+}
+
+void fill_ticks(VisualScores *vs, int *rec_index, int size, int64_t *begin_ticks)
+{
 	int repeated[FILE_LIMIT];
 	for(int i = 0; i < FILE_LIMIT; ++i)
 		repeated[i] = 0;
 	double total_time_to_prev_image = 0.0, total_time_to_cur_image = 0.0;
-	int64_t begin_pts = 0;
-	
+	/* For constant frame rate a tick is a frame. */
+	double ticks_per_second = 1.0 / av_q2d(vs -> video_info -> codec_ctx2 -> time_base);
+
+	begin_ticks[0] = 0;
 	for(int i = 0; i < size; ++i)
 	{
-		VS_print_log(WRITING_IMAGE_TRACK, i + 1, size);
+		int pos = rec_index[i];
+		AVInfo *image_info = vs -> image_info[vs -> image_pos[pos]];
+		total_time_to_cur_image += image_info -> duration[ repeated[pos] ];
+		++repeated[pos];
+		int64_t nb_ticks = (double)(total_time_to_cur_image - total_time_to_prev_image) * ticks_per_second;
+		begin_ticks[i + 1] = begin_ticks[i] + nb_ticks;
+		total_time_to_prev_image += (nb_ticks / ticks_per_second);
+	}
+}
 
-		AVInfo *image_info = vs -> image_info[vs -> image_pos[ rec_index[i] ]];
-		AVFrame *image_frame = av_frame_alloc();
-		if(!decode_image(image_info, image_frame, vs -> video_info -> width, vs -> video_info -> height))
+bool write_segments(VisualScores *vs, int *rec_index, int64_t *begin_ticks, 
+                    EncodedImage **reuse, int size, int nb_segments)
+{
+	ExportSegment segments[WORKER_LIMIT];
+	HANDLE threads[WORKER_LIMIT];
+	for(int i = 0; i < nb_segments; ++i)
+	{
+		segments[i].vs = vs;
+		segments[i].rec_index = rec_index;
+		segments[i].begin_ticks = begin_ticks;
+		segments[i].reuse = reuse;
+		segments[i].begin = (i == 0 ? 0 : segments[i - 1].end);
+		segments[i].end = FFMAX(segments[i].begin, size * (i + 1) / nb_segments);
+		/* A segment begins with an IDR picture of its own encoder; see "can_join_images". */
+		while(segments[i].end < size && 
+		      !can_join_images(vs -> video_info, ticks_written_before(begin_ticks, segments[i].end)))
+			++segments[i].end;
+		if(i == nb_segments - 1)
+			segments[i].end = size;
+		segments[i].finished = false;
+		segments[i].succeeded = false;
+		segments[i].stopped = false;
+		segments[i].queue = av_fifo_alloc2(SEGMENT_QUEUE_DEPTH, sizeof(PendingImage), 0);
+		if(!segments[i].queue)
 		{
-			av_frame_free(&image_frame);
-			AVInfo_reopen_input(image_info);
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		InitializeCriticalSection(&segments[i].lock);
+		InitializeConditionVariable(&segments[i].changed);
+		segments[i].encoder_info = AVInfo_init();
+		if(!AVInfo_open_segment(segments[i].encoder_info, vs -> video_info))
+		{
+			for(int j = 0; j <= i; ++j)
+				segment_free(&segments[j]);
 			return false;
 		}
+		count_background_uses(vs, rec_index + segments[i].begin, reuse + segments[i].begin, 
+		                      segments[i].end - segments[i].begin);
+	}
+
+	for(int i = 0; i < nb_segments; ++i)
+	{
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, segment_worker, &segments[i], 0, NULL);
+		if(threads[i] == 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+	}
 
-		if(!mix_images(image_info, vs -> bg_info, image_frame, vs -> video_info -> frame,
-		               vs -> image_pos[rec_index[i]], vs -> bg_count))
+	/* Segments are joined in order, each one while it is encoded. */
+	bool ret = true;
+	for(int i = 0; i < nb_segments; ++i)
+	{
+		ret = ret && write_segment(vs -> video_info, &segments[i]);
+		if(ret)
+			VS_print_log(WRITING_IMAGE_TRACK, segments[i].end, size);
+		else
 		{
-			av_frame_free(&image_frame);
-			AVInfo_reopen_input(image_info);
-			return false;
+			/* the encoders of the segments after it may be waiting for the queue */
+			for(int j = i; j < nb_segments; ++j)
+			{
+				EnterCriticalSection(&segments[j].lock);
+				segments[j].stopped = true;
+				LeaveCriticalSection(&segments[j].lock);
+				WakeAllConditionVariable(&segments[j].changed);
+			}
+		}
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+		segment_free(&segments[i]);
+	}
+	return ret;
+}
+
+void segment_free(ExportSegment *segment)
+{
+	PendingImage image;
+	while(av_fifo_read(segment -> queue, &image, 1) >= 0)
+		packet_array_free(&image.packets, image.nb_packets);
+	av_fifo_freep2(&segment -> queue);
+	DeleteCriticalSection(&segment -> lock);
+	AVInfo_free(segment -> encoder_info);
+}
+
+unsigned __stdcall segment_worker(void *arg)
+{
+	ExportSegment *segment = arg;
+	bool succeeded = encode_segment(segment);
+	EnterCriticalSection(&segment -> lock);
+	segment -> succeeded = succeeded;
+	segment -> finished = true;
+	LeaveCriticalSection(&segment -> lock);
+	WakeAllConditionVariable(&segment -> changed);
+	return 0;
+}
+
+bool encode_segment(ExportSegment *segment)
+{
+	VisualScores *vs = segment -> vs;
+	AVInfo *encoder_info = segment -> encoder_info;
+	AVFrame *composed[FILE_LIMIT];
+	int remaining[FILE_LIMIT];
+	for(int i = 0; i < FILE_LIMIT; ++i)
+	{
+		composed[i] = NULL;
+		remaining[i] = 0;
+	}
+	for(int i = segment -> begin; i < segment -> end; ++i)
+		if(segment -> reuse[i] == NULL)
+			++remaining[ segment -> rec_index[i] ];
+
+	bool ret = true;
+	for(int i = segment -> begin; i < segment -> end && ret; ++i)
+	{
+		int pos = segment -> rec_index[i];
+		int64_t nb_ticks = segment -> begin_ticks[i + 1] - segment -> begin_ticks[i];
+		if(segment -> reuse[i] != NULL)
+		{
+			ret = reuse_image(encoder_info, segment -> reuse[i], segment -> begin_ticks[i], 
+			                  nb_ticks, &vs -> encoded[pos]) && hand_over_images(segment);
+			continue;
 		}
-		av_frame_free(&image_frame);
 
-		total_time_to_cur_image += image_info -> duration[ repeated[rec_index[i]] ];
-		++repeated[rec_index[i]];
-		int nb_frames = (double)(total_time_to_cur_image - total_time_to_prev_image) * VS_framerate;
-		if(!encode_image(vs -> video_info, begin_pts, nb_frames))
+		if(composed[pos] == NULL)
+			composed[pos] = compose_image(vs, pos);
+		if(composed[pos] == NULL)
+		{
+			ret = false;
+			break;
+		}
+
+		if(av_frame_ref(encoder_info -> frame2, composed[pos]) < 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
+		}
+		ret = encode_image(encoder_info, segment -> begin_ticks[i], nb_ticks, &vs -> encoded[pos]);
+		av_frame_unref(encoder_info -> frame2);
+		if(--remaining[pos] == 0)
+			av_frame_free(&composed[pos]);
+		ret = ret && hand_over_images(segment);
+	}
+
+	for(int i = 0; i < FILE_LIMIT; ++i)
+		av_frame_free(&composed[i]);
+	/* every image has all of its packets after the encoder is drained */
+	return ret && flush_image_encoder(encoder_info) && hand_over_images(segment) &&
+	       av_fifo_can_read(encoder_info -> pending) == 0;
+}
+
+bool hand_over_images(ExportSegment *segment)
+{
+	AVFifo *pending = segment -> encoder_info -> pending;
+	PendingImage image;
+	while(av_fifo_peek(pending, &image, 1, 0) >= 0 && image_received(&image))
+	{
+		EnterCriticalSection(&segment -> lock);
+		while(av_fifo_can_write(segment -> queue) == 0 && !segment -> stopped)
+			SleepConditionVariableCS(&segment -> changed, &segment -> lock, INFINITE);
+		bool stopped = segment -> stopped;
+		if(!stopped)
 		{
-			AVInfo_reopen_input(image_info);
+			av_fifo_drain2(pending, 1);
+			av_fifo_write(segment -> queue, &image, 1);
+		}
+		LeaveCriticalSection(&segment -> lock);
+		if(stopped)
+			return false;
+		WakeAllConditionVariable(&segment -> changed);
+	}
+	return true;
+}
+
+bool write_segment(AVInfo *video_info, ExportSegment *segment)
+{
+	while(true)
+	{
+		EnterCriticalSection(&segment -> lock);
+		while(av_fifo_can_read(segment -> queue) == 0 && !segment -> finished)
+			SleepConditionVariableCS(&segment -> changed, &segment -> lock, INFINITE);
+		PendingImage image;
+		bool taken = (av_fifo_read(segment -> queue, &image, 1) >= 0);
+		bool succeeded = segment -> succeeded;
+		LeaveCriticalSection(&segment -> lock);
+		if(!taken)
+			return succeeded;
+		WakeAllConditionVariable(&segment -> changed);
+
+		keep_image_packets(&image);
+		bool ret = write_image_packets(video_info, &image);
+		packet_array_free(&image.packets, image.nb_packets);
+		if(!ret)
+			return false;
+	}
+}
+
+AVFrame *compose_image(VisualScores *vs, int pos)
+{
+	AVInfo *image_info = vs -> image_info[vs -> image_pos[pos]];
+	AVFrame *image_frame = av_frame_alloc();
+	AVFrame *frame = av_frame_alloc();
+	if(!image_frame || !frame)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	int bg_pos = vs -> image_pos[pos];
+	enum AVPixelFormat format = (can_compose_gray(vs, pos) ? AV_PIX_FMT_GRAY8 : vs -> video_info -> compose_fmt);
+
+	/* A repeated image may be composed by several segments at the same time. */
+	EnterCriticalSection(&image_info -> lock);
+	bool ret = decode_image(image_info, image_frame, vs -> video_info -> width, vs -> video_info -> height,
+	                        format, vs_config.quality);
+	AVInfo_reopen_input(image_info);
+	LeaveCriticalSection(&image_info -> lock);
+	ret = ret && mix_images(vs -> bg_info, vs -> bg_list + vs -> bg_offset[bg_pos],
+	                        vs -> bg_offset[bg_pos + 1] - vs -> bg_offset[bg_pos], image_frame, frame,
+	                        vs_config.quality);
+	av_frame_free(&image_frame);
+	if(!ret)
+		av_frame_free(&frame);
+	return frame;
+}
+
+bool can_compose_gray(VisualScores *vs, int pos)
+{
+	if(!vs_config.gray_pages || !vs -> image_info[vs -> image_pos[pos]] -> gray)
+		return false;
+	int bg_pos = vs -> image_pos[pos];
+	for(int k = vs -> bg_offset[bg_pos]; k < vs -> bg_offset[bg_pos + 1]; ++k)
+	{
+		AVInfo *bg = vs -> bg_info[ vs -> bg_list[k] ];
+		if(!bg -> gray || bg -> blend == BLEND_OVER)
 			return false;
+	}
+	return true;
+}
+
+ExportPipeline *pipeline_start(VisualScores *vs, int *rec_index, EncodedImage **reuse, int size)
+{
+	ExportPipeline *pipeline = malloc(sizeof(ExportPipeline));
+	if(pipeline == NULL)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	pipeline -> vs = vs;
+	pipeline -> rec_index = rec_index;
+	pipeline -> nb_jobs = 0;
+	pipeline -> next_job = 0;
+	pipeline -> next_taken = 0;
+	pipeline -> in_flight = 0;
+	pipeline -> failed = false;
+	pipeline -> stopped = false;
+	for(int i = 0; i < FILE_LIMIT; ++i)
+	{
+		pipeline -> composed[i] = NULL;
+		pipeline -> remaining[i] = 0;
+	}
+
+	/* Only the first appearance of a position is composed; later appearances reuse the frame. */
+	for(int i = 0; i < size; ++i)
+	{
+		if(reuse[i] != NULL)
+			continue;
+		if(pipeline -> remaining[rec_index[i]] == 0)
+			pipeline -> jobs[pipeline -> nb_jobs++] = i;
+		++(pipeline -> remaining[rec_index[i]]);
+	}
+
+	InitializeCriticalSection(&pipeline -> lock);
+	InitializeConditionVariable(&pipeline -> frame_ready);
+	InitializeConditionVariable(&pipeline -> slot_free);
+
+	pipeline -> nb_workers = vs_config.workers;
+	if(pipeline -> nb_workers == 0)
+		pipeline -> nb_workers = FFMAX(1, FFMIN(av_cpu_count() - 1, QUEUE_DEPTH));
+	pipeline -> nb_workers = FFMIN(pipeline -> nb_workers, FFMAX(1, pipeline -> nb_jobs));
+	for(int i = 0; i < pipeline -> nb_workers; ++i)
+	{
+		pipeline -> workers[i] = (HANDLE)_beginthreadex(NULL, 0, pipeline_worker, pipeline, 0, NULL);
+		if(pipeline -> workers[i] == 0)
+		{
+			VS_print_log(INSUFFICIENT_MEMORY);
+			system("pause >nul 2>&1");
+			abort();
 		}
+	}
+	return pipeline;
+}
 
-		begin_pts += av_rescale_q(nb_frames, vs -> video_info -> codec_ctx2 -> time_base, 
-		                                     vs -> video_info -> fmt_ctx -> streams[1] -> time_base);
-		total_time_to_prev_image += (nb_frames / VS_framerate);
-		av_frame_unref(vs -> video_info -> frame);
-		AVInfo_reopen_input(image_info);
+unsigned __stdcall pipeline_worker(void *arg)
+{
+	ExportPipeline *pipeline = arg;
+	EnterCriticalSection(&pipeline -> lock);
+	while(true)
+	{
+		while(!pipeline -> stopped && pipeline -> next_job < pipeline -> nb_jobs &&
+		      pipeline -> in_flight >= QUEUE_DEPTH)
+			SleepConditionVariableCS(&pipeline -> slot_free, &pipeline -> lock, INFINITE);
+		if(pipeline -> stopped || pipeline -> failed || pipeline -> next_job == pipeline -> nb_jobs)
+			break;
+
+		int pos = pipeline -> rec_index[ pipeline -> jobs[pipeline -> next_job] ];
+		++(pipeline -> next_job);
+		++(pipeline -> in_flight);
+		LeaveCriticalSection(&pipeline -> lock);
+
+		AVFrame *frame = compose_image(pipeline -> vs, pos);
+
+		EnterCriticalSection(&pipeline -> lock);
+		if(frame == NULL)
+			pipeline -> failed = true;
+		else  pipeline -> composed[pos] = frame;
+		WakeAllConditionVariable(&pipeline -> frame_ready);
+	}
+	LeaveCriticalSection(&pipeline -> lock);
+	return 0;
+}
+
+bool pipeline_take(ExportPipeline *pipeline, int index, AVFrame *frame)
+{
+	int pos = pipeline -> rec_index[index];
+	EnterCriticalSection(&pipeline -> lock);
+	while(pipeline -> composed[pos] == NULL && !pipeline -> failed)
+		SleepConditionVariableCS(&pipeline -> frame_ready, &pipeline -> lock, INFINITE);
+	if(pipeline -> composed[pos] == NULL)
+	{
+		LeaveCriticalSection(&pipeline -> lock);
+		return false;
+	}
+
+	if(av_frame_ref(frame, pipeline -> composed[pos]) < 0)
+	{
+		VS_print_log(INSUFFICIENT_MEMORY);
+		system("pause >nul 2>&1");
+		abort();
+	}
+
+	/* The frame leaves the queue at its first appearance, but stays cached until its last one. */
+	if(pipeline -> next_taken < pipeline -> nb_jobs && pipeline -> jobs[pipeline -> next_taken] == index)
+	{
+		++(pipeline -> next_taken);
+		--(pipeline -> in_flight);
+		WakeAllConditionVariable(&pipeline -> slot_free);
 	}
+	if(--(pipeline -> remaining[pos]) == 0)
+		av_frame_free(&pipeline -> composed[pos]);
+	LeaveCriticalSection(&pipeline -> lock);
 	return true;
 }
 
-bool write_audio_track(VisualScores *vs)
+void pipeline_stop(ExportPipeline *pipeline)
 {
-	if(vs -> audio_count > 0)
-		printf("\n");
+	EnterCriticalSection(&pipeline -> lock);
+	pipeline -> stopped = true;
+	WakeAllConditionVariable(&pipeline -> slot_free);
+	LeaveCriticalSection(&pipeline -> lock);
 
+	WaitForMultipleObjects(pipeline -> nb_workers, pipeline -> workers, TRUE, INFINITE);
+	for(int i = 0; i < pipeline -> nb_workers; ++i)
+		CloseHandle(pipeline -> workers[i]);
+	for(int i = 0; i < FILE_LIMIT; ++i)
+		av_frame_free(&pipeline -> composed[i]);
+	DeleteCriticalSection(&pipeline -> lock);
+	free(pipeline);
+}
+
+unsigned __stdcall audio_track_worker(void *arg)
+{
+	return write_audio_track((VisualScores *)arg);
+}
+
+bool write_audio_track(VisualScores *vs)
+{
 	int prev_min_begin = -1, min_begin = FILE_LIMIT, index = -1;
 	int64_t pts_from_dur = 0, pts_actual = 0;
 	for(int i = 0; i < vs -> audio_count; ++i)
@@ -11,18 +11,23 @@
 #include <string.h>
 #include <wchar.h>
 #include <windows.h>
+
+#include <libavutil/cpu.h>
  
+#include "converter.h"
 #include "vslog.h"
 #include "visualscores.h"
 
 const wchar_t short_command[COMMAND_COUNT][5] =
-	{L"-a", L"-h", L"-l", L"-q", L"-x", L"-i", L"-I", L"-o", L"-d", L"-m", L"-r", L"-t", L"-p", L"-D", L"-e"};
+	{L"-a", L"-h", L"-l", L"-q", L"-x", L"-i", L"-I", L"-o", L"-d", L"-m", L"-r", L"-t", L"-b", L"-p", L"-D", L"-e", L"-c", L"-B"};
 const wchar_t long_command[COMMAND_COUNT][10] =
 	{L"about",  L"help",   L"language", L"quit",     L"settings",  L"load",    L"loadall", L"loadother",
-	 L"delete", L"modify", L"repeat",   L"duration", L"partition", L"discard", L"export"};
+	 L"delete", L"modify", L"repeat",   L"duration", L"blend",     L"partition", L"discard", L"export",  L"config",
+	 L"benchmark"};
 void (*functions[COMMAND_COUNT]) (VisualScores *, wchar_t *) =
 	{about, help, switch_language, quit, settings, load, load_all, load_other, delete_file,
-	 modify_file, set_repetition, set_duration, partition_audio, discard_partition, export_video};
+	 modify_file, set_repetition, set_duration, set_blend_mode, partition_audio, discard_partition, export_video, config,
+	 benchmark};
 
 VisualScores *VS_init()
 {
@@ -38,6 +43,10 @@ VisualScores *VS_init()
 	vs -> audio_count = 0;
 	vs -> bg_count = 0;
 	vs -> image_pos = malloc(sizeof(int) * FILE_LIMIT);
+	vs -> encoded = NULL;
+	vs -> bg_offset = malloc(sizeof(int) * (FILE_LIMIT + 1));
+	vs -> bg_list = NULL;
+	vs -> draft = false;
 
 	vs -> image_info = malloc(sizeof(AVInfo*) * FILE_LIMIT);
 	vs -> audio_info = malloc(sizeof(AVInfo*) * FILE_LIMIT);
@@ -69,6 +78,9 @@ void VS_free(VisualScores *vs)
 		AVInfo_free(vs -> bg_info[i]);
 	free(vs -> bg_info);
 
+	free_encoded_images(vs -> encoded);
+	free(vs -> bg_offset);
+	free(vs -> bg_list);
 	free(vs);
 }
 
@@ -102,14 +114,48 @@ void help(VisualScores *vs, wchar_t *cmd)
 		         "    Set the number of repetition times of images from <Begin> to <End> in\n"
 		         "    the image track to <Times> times.\n"
 		         "-t <Tag> <Time>            duration <Tag> <Time>\n"
-		         "    Set the duration of an image file not in the range of any audio file.\n\n"
+		         "    Set the duration of an image file not in the range of any audio file.\n"
+		         "-b <Tag> <Mode>            blend <Tag> <Mode>\n"
+		         "    Set how the background image tagged <Tag> is blended with images:\n"
+		         "    darken (default), multiply or over.\n\n"
 		         "-p [Tag]                   partition [Tag]\n"
 		         "    Partition the audio file tagged [Tag] and determine the duration of\n"
 		         "    images in the range of the audio file.\n"
 		         "-D <Tag>                   discard <Tag>\n"
 		         "    Discard the partition done to the audio file tagged <Tag>.\n"
-		         "-e [Path]                  export [Path]\n"
-		         "    Export the video file to [Path]. \n\n"
+		         "-e [draft] [Path]          export [draft] [Path]\n"
+		         "    Export the video file to [Path]. With \"draft\", export a small video\n"
+		         "    file quickly to check the timing.\n"
+		         "-c [Option] [Value]        config [Option] [Value]\n"
+		         "    Show export options, or set the export option [Option] to [Value].\n"
+		         "    codec auto|h264|mpeg4         Video codec. H.264 needs libx264.\n"
+		         "    qscale <1-31>                 Quality of MPEG-4 (lower is better).\n"
+		         "    crf <0-51>                    Quality of H.264 (lower is better).\n"
+		         "    vfr on|off                    One frame per image (variable frame\n"
+		         "                                  rate, mp4/mov only).\n"
+		         "    threads auto|<N>              Number of threads of the video encoder.\n"
+		         "    threading auto|slice|frame    Threading mode of the video encoder.\n"
+		         "                                  MPEG-4 always uses slice threads.\n"
+		         "    workers auto|<N>              Number of threads preparing images.\n"
+		         "    segments off|auto|<N>         Number of parts of the image track\n"
+		         "                                  encoded at the same time.\n"
+		         "    composite rgba|yuv            Pixel format images are composed in.\n"
+		         "                                  yuv is faster; blend mode over needs rgba.\n"
+		         "    quality draft|standard|high   Scaler of the exported images.\n"
+		         "    preview draft|standard|high   Scaler of the images shown by partition.\n"
+		         "    draftbg on|off                Compose background images in drafts.\n"
+		         "    resolution auto|<H>p|<W>      Height or width of the video file, e.g.\n"
+		         "                                  2160p. auto: 1280 to 1920 wide.\n"
+		         "    scalerthreads auto|<N>        Number of threads scaling each image.\n"
+		         "    gray on|off                   Compose images without color in grayscale.\n"
+		         "    decodemem off|<MB>            Memory for decoded images shared by the\n"
+		         "                                  threads preparing images.\n"
+		         "    sourcecache off|<MB>          Memory for decoded images kept between\n"
+		         "                                  partition and export.\n"
+		         "-B                         benchmark\n"
+		         "    Compare the speed and quality of the scalers on the loaded images,\n"
+		         "    time scaling and encoding on different numbers of threads, and the\n"
+		         "    cost of writing packets.\n\n"
 		         "For detailed descriptions please refer to the user manual.\n\n");
 	}
 	else
@@ -133,13 +179,38 @@ void help(VisualScores *vs, wchar_t *cmd)
 				"-r <Begin> <End> <Times>   repeat <Begin> <End> <Times>\n"
 				"    将 <Begin> 至 <End> 范围内的图片设置重复次数 <Times> 次。\n"
 				"-t <Tag> <Time>            duration <Tag> <Time>\n"
-				"    设置不在任何一个音频范围内的图片的时长。\n\n"
+				"    设置不在任何一个音频范围内的图片的时长。\n"
+				"-b <Tag> <Mode>            blend <Tag> <Mode>\n"
+				"    设置标签为 <Tag> 的背景图片与图片的混合模式：darken（变暗，默认）、\n"
+				"    multiply（正片叠底）或 over（覆盖）。\n\n"
 				"-p [Tag]                   partition [Tag]\n"
 				"    划分标签为 [Tag] 的音频文件以决定此音频范围内的图片的时长。\n"
 				"-D <Tag>                   discard <Tag>\n"
 				"    撤销对标签为 <Tag> 的音频文件所做的划分。\n"
-				"-e [Path]                  export [Path]\n"
-				"    导出视频文件至 [Path]。\n\n"
+				"-e [draft] [Path]          export [draft] [Path]\n"
+				"    导出视频文件至 [Path]。加上 draft 则快速导出小尺寸的视频文件以检查时长。\n"
+				"-c [Option] [Value]        config [Option] [Value]\n"
+				"    显示导出选项，或将导出选项 [Option] 设置为 [Value]。\n"
+				"    codec auto|h264|mpeg4         视频编码格式。H.264 需要 libx264。\n"
+				"    qscale <1-31>                 MPEG-4 的画质（越小越好）。\n"
+				"    crf <0-51>                    H.264 的画质（越小越好）。\n"
+				"    vfr on|off                    每张图片只写入一帧（可变帧率，仅限mp4/mov）。\n"
+				"    threads auto|<N>              视频编码器的线程数。\n"
+				"    threading auto|slice|frame    视频编码器的多线程模式。MPEG-4 总是使用条带多线程。\n"
+				"    workers auto|<N>              准备图片的线程数。\n"
+				"    segments off|auto|<N>         同时编码的图片轨分段数。\n"
+				"    composite rgba|yuv            合成图片的像素格式。yuv 更快；混合模式 over 需要 rgba。\n"
+				"    quality draft|standard|high   导出图片的缩放画质。\n"
+				"    preview draft|standard|high   划分时显示图片的缩放画质。\n"
+				"    draftbg on|off                草稿是否合成背景图片。\n"
+				"    resolution auto|<H>p|<W>      视频文件的高度或宽度，如 2160p。auto：宽 1280 至 1920。\n"
+				"    scalerthreads auto|<N>        缩放每张图片的线程数。\n"
+				"    gray on|off                   以灰度合成没有颜色的图片。\n"
+				"    decodemem off|<MB>            准备图片的线程共用的已解码图片内存。\n"
+				"    sourcecache off|<MB>          在划分与导出之间保留的已解码图片内存。\n"
+				"-B                         benchmark\n"
+				"    在已载入的图片上比较各缩放画质的速度与画质，测试不同线程数下\n"
+				"    缩放与编码的用时，以及写入数据包的开销。\n\n"
 				"请参阅用户手册以获取详细描述。\n\n");
 	}
 }
@@ -156,6 +227,9 @@ void switch_language(VisualScores *vs, wchar_t *cmd)
 void quit(VisualScores *vs, wchar_t *cmd)
 {
 	VS_free(vs);
+	converter_cache_free();
+	decode_budget_free();
+	source_cache_free();
 	exit(0);
 }
 
@@ -208,7 +282,8 @@ void settings(VisualScores *vs, wchar_t *cmd)
 		for(int i = 0; i < vs -> bg_count; ++i)
 		{
 			VS_print_log(TAG_AND_FILENAME, L"BG", i + 1, vs -> bg_info[i] -> filename);
-			VS_print_log(BEGIN_AND_END, vs -> bg_info[i] -> begin, vs -> bg_info[i] -> end);
+			VS_print_log(BEGIN_END_AND_BLEND, vs -> bg_info[i] -> begin, vs -> bg_info[i] -> end, 
+			             blend_mode_name(vs -> bg_info[i] -> blend));
 		}
 	}
 
@@ -238,6 +313,271 @@ void settings(VisualScores *vs, wchar_t *cmd)
 	wprintf(L"\n");
 }
 
+void config(VisualScores *vs, wchar_t *cmd)
+{
+	if(cmd[0] == L'\0')
+	{
+		print_config();
+		return;
+	}
+
+	wchar_t option[STRING_LIMIT], value[STRING_LIMIT];
+	bool valid = config_parse_input(vs, cmd, option, value);
+	if(!valid)  return;
+
+	VS_print_log(CONFIG_SET);
+	print_config();
+}
+
+bool config_parse_input(VisualScores *vs, wchar_t *cmd, wchar_t *option, wchar_t *value)
+{
+	size_t pos = 0;
+	while(pos < wcslen(cmd) && cmd[pos] != L' ')
+		++pos;
+	wcsncpy(option, cmd, pos);
+	option[pos] = L'\0';
+	while(pos < wcslen(cmd) && cmd[pos] == L' ')
+		++pos;
+	wcscpy(value, cmd + pos);
+
+	bool valid = false;
+	if(wcscmp(option, L"codec") == 0)
+	{
+		valid = true;
+		if(wcscmp(value, L"auto") == 0)
+			vs_config.codec = VSCODEC_AUTO;
+		else if(wcscmp(value, L"h264") == 0)
+			vs_config.codec = VSCODEC_H264;
+		else if(wcscmp(value, L"mpeg4") == 0)
+			vs_config.codec = VSCODEC_MPEG4;
+		else  valid = false;
+	}
+	else if(wcscmp(option, L"qscale") == 0)
+		valid = parse_integer(value, 1, 31, &vs_config.qscale);
+	else if(wcscmp(option, L"crf") == 0)
+		valid = parse_integer(value, 0, 51, &vs_config.crf);
+	else if(wcscmp(option, L"vfr") == 0)
+		valid = parse_switch(value, &vs_config.vfr);
+	else if(wcscmp(option, L"threads") == 0)
+		valid = parse_thread_count(value, &vs_config.threads);
+	else if(wcscmp(option, L"workers") == 0)
+		valid = parse_thread_count(value, &vs_config.workers);
+	else if(wcscmp(option, L"segments") == 0)
+	{
+		if(wcscmp(value, L"off") == 0)
+		{
+			vs_config.segments = 1;
+			valid = true;
+		}
+		else  valid = parse_thread_count(value, &vs_config.segments);
+	}
+	else if(wcscmp(option, L"threading") == 0)
+	{
+		valid = true;
+		if(wcscmp(value, L"auto") == 0)
+			vs_config.thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
+		else if(wcscmp(value, L"slice") == 0)
+			vs_config.thread_type = FF_THREAD_SLICE;
+		else if(wcscmp(value, L"frame") == 0)
+		{
+			vs_config.thread_type = FF_THREAD_FRAME;
+			VS_print_log(MPEG4_SLICE_THREADS);
+		}
+		else  valid = false;
+	}
+	else if(wcscmp(option, L"composite") == 0)
+	{
+		valid = true;
+		if(wcscmp(value, L"rgba") == 0)
+			vs_config.composite = VSCOMPOSITE_RGBA;
+		else if(wcscmp(value, L"yuv") == 0)
+			vs_config.composite = VSCOMPOSITE_YUV;
+		else  valid = false;
+	}
+	else if(wcscmp(option, L"quality") == 0)
+		valid = parse_quality(value, &vs_config.quality);
+	else if(wcscmp(option, L"preview") == 0)
+		valid = parse_quality(value, &vs_config.preview_quality);
+	else if(wcscmp(option, L"draftbg") == 0)
+		valid = parse_switch(value, &vs_config.draft_backgrounds);
+	else if(wcscmp(option, L"resolution") == 0)
+		valid = parse_resolution(value, &vs_config.video_width, &vs_config.video_height);
+	else if(wcscmp(option, L"scalerthreads") == 0)
+		valid = parse_thread_count(value, &vs_config.scaler_threads);
+	else if(wcscmp(option, L"gray") == 0)
+		valid = parse_switch(value, &vs_config.gray_pages);
+	else if(wcscmp(option, L"decodemem") == 0)
+	{
+		if(wcscmp(value, L"off") == 0)
+		{
+			vs_config.decode_memory = 0;
+			valid = true;
+		}
+		else  valid = parse_integer(value, 64, 65536, &vs_config.decode_memory);
+	}
+	else if(wcscmp(option, L"sourcecache") == 0)
+	{
+		if(wcscmp(value, L"off") == 0)
+		{
+			vs_config.source_cache = 0;
+			valid = true;
+		}
+		else  valid = parse_integer(value, 64, 65536, &vs_config.source_cache);
+		if(valid)
+			source_cache_shrink(0);
+	}
+
+	if(!valid)
+		VS_print_log(INVALID_INPUT);
+	return valid;
+}
+
+bool parse_switch(wchar_t *value, bool *result)
+{
+	if(wcscmp(value, L"on") == 0)
+		*result = true;
+	else if(wcscmp(value, L"off") == 0)
+		*result = false;
+	else  return false;
+	return true;
+}
+
+bool parse_quality(wchar_t *value, VSQuality *result)
+{
+	if(wcscmp(value, L"draft") == 0)
+		*result = VSQUALITY_DRAFT;
+	else if(wcscmp(value, L"standard") == 0)
+		*result = VSQUALITY_STANDARD;
+	else if(wcscmp(value, L"high") == 0)
+		*result = VSQUALITY_HIGH;
+	else  return false;
+	return true;
+}
+
+bool parse_resolution(wchar_t *value, int *width, int *height)
+{
+	if(wcscmp(value, L"auto") == 0)
+	{
+		*width = 0;
+		*height = 0;
+		return true;
+	}
+
+	wchar_t number[STRING_LIMIT];
+	wcscpy_s(number, STRING_LIMIT, value);
+	size_t len = wcslen(number);
+	if(len > 0 && number[len - 1] == L'p')
+	{
+		number[len - 1] = L'\0';
+		if(!parse_integer(number, 240, 4320, height))
+			return false;
+		*width = 0;
+		return true;
+	}
+
+	if(!parse_integer(number, 320, 7680, width))
+		return false;
+	*height = 0;
+	return true;
+}
+
+bool parse_thread_count(wchar_t *value, int *result)
+{
+	if(wcscmp(value, L"auto") == 0)
+	{
+		*result = 0;
+		return true;
+	}
+
+	return parse_integer(value, 1, WORKER_LIMIT, result);
+}
+
+bool parse_integer(wchar_t *value, int min, int max, int *result)
+{
+	wchar_t *pEnd;
+	int number = wcstol(value, &pEnd, 10);
+	if(value[0] < L'0' || value[0] > L'9' || *pEnd != L'\0' || number < min || number > max)
+		return false;
+	*result = number;
+	return true;
+}
+
+void print_config()
+{
+	VS_print_log(CONFIG_HEAD);
+	const wchar_t *codec = L"auto";
+	if(vs_config.codec == VSCODEC_H264)
+		codec = L"h264";
+	else if(vs_config.codec == VSCODEC_MPEG4)
+		codec = L"mpeg4";
+	VS_print_log(CONFIG_OPTION, L"codec", codec);
+
+	wchar_t quality[20];
+	swprintf(quality, 20, L"%d", vs_config.qscale);
+	VS_print_log(CONFIG_OPTION, L"qscale", quality);
+	swprintf(quality, 20, L"%d", vs_config.crf);
+	VS_print_log(CONFIG_OPTION, L"crf", quality);
+	VS_print_log(CONFIG_OPTION, L"vfr", (vs_config.vfr ? L"on" : L"off"));
+
+	wchar_t threads[20];
+	if(vs_config.threads == 0)
+		swprintf(threads, 20, L"auto (%d cores)", av_cpu_count());
+	else  swprintf(threads, 20, L"%d", vs_config.threads);
+	VS_print_log(CONFIG_OPTION, L"threads", threads);
+
+	const wchar_t *thread_type = L"auto";
+	if(vs_config.thread_type == FF_THREAD_SLICE)
+		thread_type = L"slice";
+	else if(vs_config.thread_type == FF_THREAD_FRAME)
+		thread_type = L"frame";
+	VS_print_log(CONFIG_OPTION, L"threading", thread_type);
+
+	wchar_t workers[20];
+	if(vs_config.workers == 0)
+		swprintf(workers, 20, L"auto");
+	else  swprintf(workers, 20, L"%d", vs_config.workers);
+	VS_print_log(CONFIG_OPTION, L"workers", workers);
+
+	wchar_t segments[20];
+	if(vs_config.segments == 0)
+		swprintf(segments, 20, L"auto");
+	else if(vs_config.segments == 1)
+		swprintf(segments, 20, L"off");
+	else  swprintf(segments, 20, L"%d", vs_config.segments);
+	VS_print_log(CONFIG_OPTION, L"segments", segments);
+	VS_print_log(CONFIG_OPTION, L"composite", (vs_config.composite == VSCOMPOSITE_YUV ? L"yuv" : L"rgba"));
+	VS_print_log(CONFIG_OPTION, L"quality", quality_name(vs_config.quality));
+	VS_print_log(CONFIG_OPTION, L"preview", quality_name(vs_config.preview_quality));
+	VS_print_log(CONFIG_OPTION, L"draftbg", (vs_config.draft_backgrounds ? L"on" : L"off"));
+
+	wchar_t resolution[20];
+	if(vs_config.video_width > 0)
+		swprintf(resolution, 20, L"%d", vs_config.video_width);
+	else if(vs_config.video_height > 0)
+		swprintf(resolution, 20, L"%dp", vs_config.video_height);
+	else  swprintf(resolution, 20, L"auto");
+	VS_print_log(CONFIG_OPTION, L"resolution", resolution);
+
+	wchar_t scaler_threads[20];
+	if(vs_config.scaler_threads == 0)
+		swprintf(scaler_threads, 20, L"auto");
+	else  swprintf(scaler_threads, 20, L"%d", vs_config.scaler_threads);
+	VS_print_log(CONFIG_OPTION, L"scalerthreads", scaler_threads);
+	VS_print_log(CONFIG_OPTION, L"gray", (vs_config.gray_pages ? L"on" : L"off"));
+
+	wchar_t decode_memory[20];
+	if(vs_config.decode_memory == 0)
+		swprintf(decode_memory, 20, L"off");
+	else  swprintf(decode_memory, 20, L"%d MB", vs_config.decode_memory);
+	VS_print_log(CONFIG_OPTION, L"decodemem", decode_memory);
+	wchar_t source_cache[20];
+	if(vs_config.source_cache == 0)
+		swprintf(source_cache, 20, L"off");
+	else  swprintf(source_cache, 20, L"%d MB", vs_config.source_cache);
+	VS_print_log(CONFIG_OPTION, L"sourcecache", source_cache);
+	if(!muted)  wprintf(L"\n");
+}
+
 int fill_index(VisualScores *vs, int begin, int end, int *rec_index)
 {
 	int index = begin, size = 0;
@@ -304,6 +644,9 @@ int main()
 
 	setlocale(LC_ALL, "");
 	av_log_set_level(AV_LOG_QUIET);
+	converter_cache_init();
+	decode_budget_init();
+	source_cache_init();
 	VisualScores *vs = VS_init();
 
 	wchar_t null[1] = L"";
@@ -29,7 +29,11 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 		L"duration: set\n",
 		L"duration: %.2f(s)\n",
 		L"begin: I%d, end: I%d\n",
+		L"begin: I%d, end: I%d, blend: %ls\n",
 		L"    begin: I%d, end: I%d, %d time(s)\n",
+		L"\nExport options:\n",
+		L"    %ls: %ls\n",
+		L"Successfully set export option.\n",
 
 		L"File limit exceeded. Failed to load file.\n\n",
 		L"Warning: file limit exceeded. Loading stopped.\n",
@@ -52,12 +56,13 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 		L"Successfullt set repetition times.\n",
 		L"The duration of the image file can not be changed since it is in the range of an audio file.\n\n",
 		L"Successfully set duration.\n",
+		L"Successfully set blend mode.\n",
 
 		L"You have to load an audio file first.\n\n",
 		L"All audio files have been partitioned.\n\n",
 		L"This audio file does not need to partition.\n\n",
-		L"Creating bmp files for display...\n",
-		L"ERROR: Failed to create bmp files.\n\n",
+		L"Rendering previews for display...\n",
+		L"ERROR: Failed to render previews.\n\n",
 		L"Creating wav file for audition...\n",
 		L"ERROR: Failed to create wav file.\n\n",
 		L"ERROR: Failed to display images.\n\n",
@@ -70,10 +75,33 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 		
 		L"The duration of image file I%d is not set.\n\n",
 		L"Time limit exceeded. Failed to export video.\n\n",
+		L"Exporting a draft at %dx%d...\n",
+		L"%d of %d image(s) are unchanged since the last export and will not be encoded again.\n",
 		L"Writing image track: %d/%d\n",
 		L"Writing audio track: %d/%d\n",
 		L"Failed to export video file.\n\n",
-		L"Export completed.\n\n"
+		L"Warning: avi files do not support variable frame rate. Constant frame rate is used.\n",
+		L"Warning: libx264 is not available. MPEG-4 is used.\n",
+		L"Note: the MPEG-4 encoder has no frame threads and uses slice threads instead.\n",
+		L"Warning: blend mode \"over\" needs RGBA composition. RGBA is used.\n",
+		L"Warning: the exported video file failed the playback check. It may not play in some players.\n",
+		L"Average bitrate of each image:\n",
+		L"    I%d: %.1f kbit/s\n",
+		L"Average bitrate of the image track: %.1f kbit/s\n",
+		L"Time elapsed: %.2f(s)\n",
+		L"Peak memory usage of the export: %.1f MB\n",
+		L"Scaler cache: %d hit(s), %d miss(es); resampler cache: %d hit(s), %d miss(es)\n",
+		L"Decoded image cache: %d hit(s), %d decoding(s), %.1f MB kept\n",
+		L"Export completed.\n\n",
+		L"Scaling %d image(s) to %dx%d with each quality tier:\n",
+		L"    %ls: %.3f(s) (reference)\n",
+		L"    %ls: %.3f(s), PSNR: %.2f dB\n",
+		L"Scaling with Lanczos on different numbers of threads:\n",
+		L"    %d thread(s): %.3f(s)\n",
+		L"Writing %d frames of still images without the muxer: %.1f ns per frame with a new packet each, %.1f ns with a reused one\n",
+		L"Encoding %d frames of the loaded images in %ls on different numbers of threads:\n",
+		L"    %d thread(s): %.3f(s), %.1f fps\n",
+		L"ERROR: Failed to decode image file I%d.\n\n"
 	}, {
 		L"",
 		L"错误：内存不足。程序已退出。\n",
@@ -90,7 +118,11 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 		L"时长：已设置\n",
 		L"时长：%.2f（秒）\n",
 		L"开始：I%d，结束：I%d\n",
+		L"开始：I%d，结束：I%d，混合：%ls\n",
 		L"    开始：I%d，结束：I%d，次数：%d\n",
+		L"\n导出选项：\n",
+		L"    %ls：%ls\n",
+		L"成功设置导出选项。\n",
 
 		L"超过文件数量上限。载入失败。\n\n",
 		L"警告：超过文件数量上限。停止载入。\n\n",
@@ -113,12 +145,13 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 		L"成功设置反复次数。\n",
 		L"无法改变该图片文件的时长，因为它在某个音频文件的范围中。\n\n",
 		L"成功设置时长。\n",
+		L"成功设置混合模式。\n",
 
 		L"您需要先载入音频文件。\n\n",
 		L"所有音频文件都被划分过了。\n\n",
 		L"该音频文件无需划分。\n\n",
-		L"正在创建bmp预览图…\n",
-		L"错误：无法创建bmp预览图。\n\n",
+		L"正在生成预览图…\n",
+		L"错误：无法生成预览图。\n\n",
 		L"正在创建wav音频…\n",
 		L"错误：无法创建wav音频。\n\n",
 		L"错误：无法预览图片。\n\n",
@@ -131,10 +164,33 @@ const wchar_t vs_log[2][VS_LOG_COUNT][STRING_LIMIT] = {
 
 		L"未设置图片 I%d 的时长。\n\n",
 		L"视频时长超过限制。导出视频失败。\n\n",
+		L"正在以 %dx%d 导出草稿……\n",
+		L"自上次导出以来未改变的图片：%d/%d，将不再重新编码。\n",
 		L"正在导出图片轨：%d/%d\n",
 		L"正在导出音频轨：%d/%d\n",
 		L"视频导出失败。\n\n",
-		L"导出完成。\n\n"
+		L"警告：avi文件不支持可变帧率。将使用固定帧率。\n",
+		L"警告：libx264 不可用，改用 MPEG-4 编码。\n",
+		L"注意：MPEG-4 编码器不支持帧级多线程，改用条带多线程。\n",
+		L"警告：混合模式 over 需要 RGBA 合成。已使用 RGBA。\n",
+		L"警告：导出的视频文件未通过播放检查，可能无法在部分播放器中播放。\n",
+		L"各图片的平均码率：\n",
+		L"    I%d：%.1f kbit/s\n",
+		L"图片轨平均码率：%.1f kbit/s\n",
+		L"用时：%.2f（秒）\n",
+		L"导出时的内存用量峰值：%.1f MB\n",
+		L"缩放器缓存：命中 %d 次，未命中 %d 次；重采样器缓存：命中 %d 次，未命中 %d 次\n",
+		L"已解码图片缓存：命中 %d 次，解码 %d 次，保留 %.1f MB\n",
+		L"导出完成。\n\n",
+		L"以各画质等级将 %d 张图片缩放至 %dx%d：\n",
+		L"    %ls：%.3f（秒）（参照）\n",
+		L"    %ls：%.3f（秒），PSNR：%.2f dB\n",
+		L"以不同线程数进行 Lanczos 缩放：\n",
+		L"    %d 个线程：%.3f（秒）\n",
+		L"不经封装器写入静止图片的 %d 帧：每帧新建数据包 %.1f 纳秒/帧，复用数据包 %.1f 纳秒/帧\n",
+		L"以不同线程数将已载入图片的 %d 帧编码为 %ls：\n",
+		L"    %d 个线程：%.3f（秒），%.1f 帧/秒\n",
+		L"错误：无法解码图片文件 I%d。\n\n"
 	}
 };
 